@@ -0,0 +1,497 @@
+/* Radio hot path benchmark.
+ *
+ * Times rf24_initialize, rf24_open_reading_pipe, rf24_sync_status, rf24_send
+ * and rf24_receive and prints calls/s and p50/p99/max latency for each, with
+ * the transport calls and system calls one call costs on average.
+ *
+ * By default the radios are emulated (rf24_emu.h): a sender and a listening
+ * receiver on one virtual channel. With -d the sender is a real nRF24L01+ on
+ * spidev; there is no receiver then, so sends end in MAX_RT unless some other
+ * node listens on the address.
+ *
+ * With emulated radios rf24_bulk_send is timed too, against a receiver
+ * serviced by an rf24_thread. The emulator delivers frames the moment they
+ * are sent, so its goodput says more about the host than about the air. The
+ * receiver thread asks for SCHED_FIFO: on one core a time-shared one only
+ * runs once the sender sleeps, long after its RX FIFO overflowed.
+ *
+ * The bench is linked against the library objects with -Wl,--wrap for the
+ * calls that end up as syscalls, see the bench target in the Makefile.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <poll.h>
+#include <sys/ioctl.h>
+
+#include "rf24.h"
+#include "rf24_emu.h"
+#include "rf24_thread.h"
+#include "rf24_bulk.h"
+
+#define BENCH_ADDRESS 0xF0F0F0F0E1LL
+
+/* SCHED_FIFO priority of the bulk receiver thread */
+#define BENCH_RX_PRIORITY 50
+
+struct bench_counters {
+  uint64_t syscalls;
+  uint64_t transfers, xfers, csn, ce, irq_waits;
+};
+
+static struct bench_counters counters;
+
+/* --- syscall counting, the linker routes the library's calls through these --- */
+
+int __real_ioctl(int fd, unsigned long request, void * arg);
+ssize_t __real_read(int fd, void * buf, size_t count);
+ssize_t __real_write(int fd, const void * buf, size_t count);
+ssize_t __real_pread(int fd, void * buf, size_t count, off_t offset);
+ssize_t __real_pwrite(int fd, const void * buf, size_t count, off_t offset);
+int __real_poll(struct pollfd * fds, nfds_t nfds, int timeout);
+int __real_usleep(useconds_t usec);
+int __real_clock_nanosleep(clockid_t clock, int flags, const struct timespec * request, struct timespec * remain);
+
+int __wrap_ioctl(int fd, unsigned long request, void * arg)
+{
+  counters.syscalls++;
+  return __real_ioctl(fd, request, arg);
+}
+
+ssize_t __wrap_read(int fd, void * buf, size_t count)
+{
+  counters.syscalls++;
+  return __real_read(fd, buf, count);
+}
+
+ssize_t __wrap_write(int fd, const void * buf, size_t count)
+{
+  counters.syscalls++;
+  return __real_write(fd, buf, count);
+}
+
+ssize_t __wrap_pread(int fd, void * buf, size_t count, off_t offset)
+{
+  counters.syscalls++;
+  return __real_pread(fd, buf, count, offset);
+}
+
+ssize_t __wrap_pwrite(int fd, const void * buf, size_t count, off_t offset)
+{
+  counters.syscalls++;
+  return __real_pwrite(fd, buf, count, offset);
+}
+
+int __wrap_poll(struct pollfd * fds, nfds_t nfds, int timeout)
+{
+  counters.syscalls++;
+  return __real_poll(fds, nfds, timeout);
+}
+
+int __wrap_usleep(useconds_t usec)
+{
+  counters.syscalls++;
+  return __real_usleep(usec);
+}
+
+int __wrap_clock_nanosleep(clockid_t clock, int flags, const struct timespec * request, struct timespec * remain)
+{
+  counters.syscalls++;
+  return __real_clock_nanosleep(clock, flags, request, remain);
+}
+
+/* --- transport shim counting what the radio asks of the bus --- */
+
+struct bench_shim {
+  const rf24_transport_t * transport;
+  void * ctx;
+};
+
+static int8_t bench_transfer(void * ctx, spi_msg_t * msg, uint8_t first, uint8_t count)
+{
+  struct bench_shim * shim = (struct bench_shim *) ctx;
+
+  counters.transfers++;
+  counters.xfers += count;
+  return shim->transport->transfer(shim->ctx, msg, first, count);
+}
+
+static void bench_csn(void * ctx, uint8_t level)
+{
+  struct bench_shim * shim = (struct bench_shim *) ctx;
+
+  counters.csn++;
+  shim->transport->csn(shim->ctx, level);
+}
+
+static void bench_ce(void * ctx, uint8_t level)
+{
+  struct bench_shim * shim = (struct bench_shim *) ctx;
+
+  counters.ce++;
+  shim->transport->ce(shim->ctx, level);
+}
+
+static int8_t bench_irq_wait(void * ctx, int32_t timeout_ms, uint64_t * timestamp_ns)
+{
+  struct bench_shim * shim = (struct bench_shim *) ctx;
+
+  counters.irq_waits++;
+  return shim->transport->irq_wait(shim->ctx, timeout_ms, timestamp_ns);
+}
+
+static int32_t bench_irq_fd(void * ctx, uint32_t * events)
+{
+  struct bench_shim * shim = (struct bench_shim *) ctx;
+
+  if (shim->transport->irq_fd == NULL) { return -1; }
+  return shim->transport->irq_fd(shim->ctx, events);
+}
+
+static rf24_transport_t bench_transport = {
+  .transfer = bench_transfer,
+  .csn      = bench_csn,
+  .ce       = bench_ce,
+  .irq_wait = bench_irq_wait,
+  .irq_fd   = bench_irq_fd,
+};
+
+static rf24_transport_t bench_transport_hw_cs = {
+  .transfer = bench_transfer,
+  .csn      = NULL,
+  .ce       = bench_ce,
+  .irq_wait = bench_irq_wait,
+  .irq_fd   = bench_irq_fd,
+};
+
+static void bench_wrap(rf24_t * radio, struct bench_shim * shim)
+{
+  shim->transport = radio->transport;
+  shim->ctx       = radio->transport_ctx;
+
+  radio->transport     = shim->transport->csn != NULL ? &bench_transport : &bench_transport_hw_cs;
+  radio->transport_ctx = shim;
+}
+
+/* --- bulk receiver, fed from the service thread --- */
+
+static rf24_bulk_rx_t bench_bulk_rx;
+static const uint8_t * bench_bulk_data;
+static uint32_t bench_bulk_intact, bench_bulk_corrupt;
+
+static void bench_bulk_receive(void * radio)
+{
+  rf24_frame_t frames[RF24_RX_FIFO_DEPTH];
+  int8_t count, i;
+
+  /* every ack payload that goes out raises TX_DS, clear it before draining */
+  rf24_reset_status((rf24_t *) radio);
+  count = rf24_receive_all((rf24_t *) radio, frames, RF24_RX_FIFO_DEPTH);
+  for (i = 0; i < count; i++) {
+    if (rf24_bulk_rx_input(&bench_bulk_rx, frames[i].pipe, frames[i].data, frames[i].len) != 1) { continue; }
+
+    if (bench_bulk_rx.len == bench_bulk_rx.max_len && memcmp(bench_bulk_rx.buf, bench_bulk_data, bench_bulk_rx.len) == 0) {
+      bench_bulk_intact++;
+    } else {
+      bench_bulk_corrupt++;
+    }
+    /* wiped, so a frame missing from the next transfer can not pass for this one's */
+    memset(bench_bulk_rx.buf, 0, bench_bulk_rx.max_len);
+  }
+  rf24_bulk_rx_ack(&bench_bulk_rx, (rf24_t *) radio);
+}
+
+/* --- measurements --- */
+
+struct bench_result {
+  const char * name;
+  uint32_t calls;
+  uint64_t * ns;
+  uint64_t total_ns;
+  struct bench_counters used;
+};
+
+static uint64_t bench_now_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int bench_cmp(const void * a, const void * b)
+{
+  uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+  return x < y ? -1 : x > y;
+}
+
+static void bench_begin(struct bench_result * r, const char * name, uint32_t calls)
+{
+  memset(r, 0, sizeof(struct bench_result));
+  r->name  = name;
+  r->calls = calls;
+  r->ns    = calloc(calls, sizeof(uint64_t));
+}
+
+/* time one call of the operation, only the part between start and stop counts */
+static uint64_t bench_start(struct bench_counters * snap)
+{
+  *snap = counters;
+  return bench_now_ns();
+}
+
+static void bench_stop(struct bench_result * r, uint32_t i, uint64_t start, struct bench_counters * snap)
+{
+  uint64_t elapsed = bench_now_ns() - start;
+
+  r->ns[i]             = elapsed;
+  r->total_ns         += elapsed;
+  r->used.syscalls    += counters.syscalls  - snap->syscalls;
+  r->used.transfers   += counters.transfers - snap->transfers;
+  r->used.xfers       += counters.xfers     - snap->xfers;
+  r->used.csn         += counters.csn       - snap->csn;
+  r->used.ce          += counters.ce        - snap->ce;
+  r->used.irq_waits   += counters.irq_waits - snap->irq_waits;
+}
+
+static void bench_report(struct bench_result * r)
+{
+  double n = r->calls;
+
+  qsort(r->ns, r->calls, sizeof(uint64_t), bench_cmp);
+
+  printf("%-24s %7u %10.0f %9.1f %9.1f %9.1f %8.2f %8.2f %8.2f %8.2f\n",
+      r->name,
+      r->calls,
+      r->total_ns ? n * 1e9 / r->total_ns : 0.0,
+      r->ns[r->calls / 2] / 1e3,
+      r->ns[(uint32_t) (r->calls * 0.99)] / 1e3,
+      r->ns[r->calls - 1] / 1e3,
+      r->used.transfers / n,
+      r->used.xfers / n,
+      (r->used.csn + r->used.ce) / n,
+      r->used.syscalls / n);
+
+  free(r->ns);
+}
+
+static void usage(const char * name)
+{
+  fprintf(stderr,
+      "usage: %s [-n calls] [-s payload size] [-l loss per mille] [-w bulk window] [-d spidev -c ce pin -i irq pin [-x csn pin]]\n",
+      name);
+  exit(1);
+}
+
+int main(int argc, char ** argv)
+{
+  struct bench_counters snap;
+  struct bench_result r;
+  rf24_stats_t stats;
+  struct bench_shim tx_shim, rx_shim, init_shim;
+  rf24_emu_air_t air, init_air;
+  rf24_emu_t tx_emu, rx_emu, init_emu;
+  rf24_t * tx, * rx = NULL, * radio;
+  rf24_thread_t rx_thread;
+  rf24_thread_attr_t rx_attr;
+  rf24_bulk_tx_t bulk;
+  uint8_t * bulk_data, * bulk_buf;
+  uint32_t bulk_len, bulk_ok = 0;
+  double send_rate = 0;
+  char * spi_dev = NULL;
+  uint8_t payload[RF24_MAX_PAYLOAD], buf[RF24_MAX_PAYLOAD];
+  uint32_t calls = 1000, i, sent = 0, received = 0;
+  uint16_t loss = 0;
+  uint8_t size = RF24_MAX_PAYLOAD, window = 16, ce_pin = 0, irq_pin = 0, csn_pin = RF24_CSN_HW;
+  uint64_t start;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "n:s:l:w:d:c:i:x:")) != -1) {
+    switch (opt) {
+      case 'n': calls   = atoi(optarg); break;
+      case 's': size    = atoi(optarg); break;
+      case 'l': loss    = atoi(optarg); break;
+      case 'w': window  = atoi(optarg); break;
+      case 'd': spi_dev = optarg;       break;
+      case 'c': ce_pin  = atoi(optarg); break;
+      case 'i': irq_pin = atoi(optarg); break;
+      case 'x': csn_pin = atoi(optarg); break;
+      default:  usage(argv[0]);
+    }
+  }
+  if (calls == 0 || size == 0 || size > RF24_MAX_PAYLOAD || window > RF24_BULK_MAX_WINDOW) { usage(argv[0]); }
+
+  for (i = 0; i < size; i++) { payload[i] = i; }
+
+  tx = calloc(1, sizeof(rf24_t));
+
+  if (spi_dev != NULL) {
+    if (rf24_initialize_csn(tx, spi_dev, ce_pin, irq_pin, csn_pin) == (uint8_t) -1) {
+      fprintf(stderr, "[bench] Error initializing radio on %s.\n", spi_dev);
+      return 1;
+    }
+  } else {
+    rx = calloc(1, sizeof(rf24_t));
+    rf24_emu_air_init(&air, loss);
+    rf24_emu_init(&tx_emu, &air);
+    rf24_emu_init(&rx_emu, &air);
+    rf24_initialize_transport(tx, &rf24_emu_transport, &tx_emu);
+    rf24_initialize_transport(rx, &rf24_emu_transport, &rx_emu);
+    rf24_set_payload_size(rx, size);
+    rf24_open_reading_pipe(rx, 1, BENCH_ADDRESS);
+    rf24_start_listening(rx);
+    bench_wrap(rx, &rx_shim);
+  }
+  rf24_set_payload_size(tx, size);
+  rf24_open_writing_pipe(tx, BENCH_ADDRESS);
+  bench_wrap(tx, &tx_shim);
+
+  printf("%s, %u calls, %u byte payloads\n\n", spi_dev != NULL ? spi_dev : "emulated radios", calls, size);
+  printf("%-24s %7s %10s %9s %9s %9s %8s %8s %8s %8s\n",
+      "operation", "calls", "calls/s", "p50 us", "p99 us", "max us", "msgs", "xfers", "gpio", "syscalls");
+
+  /* initialization is heavy, a tenth of the calls is plenty */
+  bench_begin(&r, "rf24_initialize", calls / 10 ? calls / 10 : 1);
+  for (i = 0; i < r.calls; i++) {
+    radio = malloc(sizeof(rf24_t));
+    if (spi_dev != NULL) {
+      start = bench_start(&snap);
+      rf24_initialize_csn(radio, spi_dev, ce_pin, irq_pin, csn_pin);
+      bench_stop(&r, i, start, &snap);
+      rf24_delete(radio);
+    } else {
+      rf24_emu_air_init(&init_air, 0);
+      rf24_emu_init(&init_emu, &init_air);
+      init_shim.transport = &rf24_emu_transport;
+      init_shim.ctx       = &init_emu;
+      start = bench_start(&snap);
+      rf24_initialize_transport(radio, &bench_transport_hw_cs, &init_shim);
+      bench_stop(&r, i, start, &snap);
+      rf24_emu_destroy(&init_emu);
+      rf24_emu_air_destroy(&init_air);
+      free(radio);
+    }
+  }
+  bench_report(&r);
+
+  bench_begin(&r, "rf24_open_reading_pipe", calls);
+  for (i = 0; i < calls; i++) {
+    start = bench_start(&snap);
+    rf24_open_reading_pipe(tx, 2 + (i & 1), BENCH_ADDRESS + 1 + (i & 1));
+    bench_stop(&r, i, start, &snap);
+  }
+  bench_report(&r);
+
+  bench_begin(&r, "rf24_sync_status", calls);
+  for (i = 0; i < calls; i++) {
+    start = bench_start(&snap);
+    rf24_sync_status(tx);
+    bench_stop(&r, i, start, &snap);
+  }
+  bench_report(&r);
+
+  bench_begin(&r, "rf24_send", calls);
+  for (i = 0; i < calls; i++) {
+    start = bench_start(&snap);
+    sent += rf24_send(tx, payload, size) ? 1 : 0;
+    bench_stop(&r, i, start, &snap);
+    rf24_reset_status(tx);
+
+    /* keep the receiver FIFO from filling up, it stops acking then */
+    if (rx != NULL) {
+      rf24_receive(rx, buf, size);
+      rf24_reset_status(rx);
+    }
+  }
+  send_rate = r.total_ns ? (double) sent * size * 1e9 / r.total_ns : 0;
+  bench_report(&r);
+
+  bench_begin(&r, "rf24_receive", calls);
+  for (i = 0; i < calls; i++) {
+    if (rx != NULL) {
+      rf24_send(tx, payload, size);
+      rf24_reset_status(tx);
+      radio = rx;
+    } else {
+      radio = tx;
+    }
+
+    start = bench_start(&snap);
+    rf24_receive(radio, buf, size);
+    bench_stop(&r, i, start, &snap);
+
+    received += memcmp(buf, payload, size) == 0 ? 1 : 0;
+    rf24_reset_status(radio);
+  }
+  bench_report(&r);
+
+  /* one transfer is four windows of frames; the receiver thread's transport calls count in too */
+  if (rx != NULL && window > 0) {
+    bulk_len  = RF24_BULK_CHUNK * window * 4;
+    bulk_data = malloc(bulk_len);
+    bulk_buf  = malloc(bulk_len);
+    for (i = 0; i < bulk_len; i++) { bulk_data[i] = i * 7; }
+    memset(bulk_buf, 0, bulk_len);
+    bench_bulk_data = bulk_data;
+
+    rf24_enable_dynamic_payloads(tx);
+    rf24_enable_ack_payload(tx);
+    rf24_enable_dynamic_payloads(rx);
+    rf24_enable_ack_payload(rx);
+    rf24_bulk_rx_init(&bench_bulk_rx, bulk_buf, bulk_len);
+    rf24_bulk_tx_init(&bulk, tx, window);
+    rf24_thread_attr_init(&rx_attr);
+    rx_attr.priority = BENCH_RX_PRIORITY;
+    if (rf24_thread_start(&rx_thread, rx, bench_bulk_receive, &rx_attr) == -1) {
+      fprintf(stderr, "[bench] Bulk receiver runs time-shared, expect it to drop frames.\n");
+      rf24_thread_start(&rx_thread, rx, bench_bulk_receive, NULL);
+    }
+
+    bench_begin(&r, "rf24_bulk_send", calls / 10 ? calls / 10 : 1);
+    for (i = 0; i < r.calls; i++) {
+      start = bench_start(&snap);
+      bulk_ok += rf24_bulk_send(&bulk, bulk_data, bulk_len) == 0 ? 1 : 0;
+      bench_stop(&r, i, start, &snap);
+    }
+    rf24_thread_stop(&rx_thread);
+
+    printf("\nbulk: window %u, %u/%u transfers of %u bytes, %u intact, %u corrupt, %.0f bytes/s (rf24_send %.0f bytes/s), "
+        "%u frames, %u retransmits, %u windows, %u polls\n",
+        window, bulk_ok, r.calls, bulk_len, bench_bulk_intact, bench_bulk_corrupt, r.total_ns ? (double) bulk_ok * bulk_len * 1e9 / r.total_ns : 0.0, send_rate,
+        bulk.stats.frames, bulk.stats.retransmits, bulk.stats.windows, bulk.stats.polls);
+    printf("%-24s %7s %10s %9s %9s %9s %8s %8s %8s %8s\n",
+        "operation", "calls", "calls/s", "p50 us", "p99 us", "max us", "msgs", "xfers", "gpio", "syscalls");
+    bench_report(&r);
+
+    free(bulk_data);
+    free(bulk_buf);
+  }
+
+  printf("\nsent %u/%u acked, received %u/%u intact\n", sent, calls, received, calls);
+
+  rf24_get_stats(tx, &stats);
+  printf("sender: %u transactions, %u SPI messages, %u GPIO writes, tx ok %u, max rt %u, timeouts %u, fifo full %u\n",
+      stats.spi_transactions, stats.spi_messages, stats.gpio_writes,
+      stats.tx_ok, stats.tx_max_rt, stats.tx_timeouts, stats.tx_fifo_full);
+  printf("sender: send latency");
+  for (i = 0; i < RF24_HISTOGRAM_BUCKETS; i++) {
+    if (stats.send_latency.buckets[i]) {
+      printf(" <%uus:%u", 1U << i, stats.send_latency.buckets[i]);
+    }
+  }
+  printf(", max %uus\n", stats.send_latency.max_us);
+
+  if (rx != NULL) {
+    rf24_get_stats(rx, &stats);
+    printf("receiver: %u payloads, rx fifo full %u\n", stats.rx_payloads, stats.rx_fifo_full);
+  }
+  if (spi_dev == NULL) {
+    printf("air: %u frames, %u retries, %u failed; receiver dropped %u\n",
+        tx_emu.stats.tx_packets, tx_emu.stats.tx_retries, tx_emu.stats.tx_failed, rx_emu.stats.rx_dropped);
+  }
+
+  return 0;
+}
+// vim:ai:cin:et:sts=2 sw=2 ft=c
@@ -3,8 +3,10 @@
 #include <string.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <pthread.h>
 #include <curl/curl.h>
 #include "rf24.h"
+#include "rf24_ring.h"
 
 #define URL       "http://localhost:9292/"
 #define HTTP_AUTH "api:b7273d35bb1926e56a9671fca815c99b"
@@ -40,38 +42,38 @@ void post_data(int node, float temp, float voltage)
   curl_easy_cleanup(curl);
 }
 
-void send_pong(void * data)
+void post_frame(rf24_frame_t * frame)
 {
-  char buf[32];
+  char buf[RF24_MAX_PAYLOAD + 1];
   int node, volt, temp;
-  uint8_t i, len;
-
-  rf24_t * radio = (rf24_t *) data;
-
-  rf24_sync_status(radio);
-
-  fprintf(stderr, "[rf24 pong callback] Got IRQ on pin %d. TX ok: %d, TX fail: %d RX ready: %d RX_LEN: %d PIPE: %d\n",
-      radio->irq_pin,
-      radio->status.tx_ok,
-      radio->status.tx_fail_retries,
-      radio->status.rx_data_available,
-      radio->status.rx_data_len,
-      radio->status.rx_data_pipe
-      );
-
-  if (radio->status.rx_data_available) {
-    len = radio->status.rx_data_len;
-    rf24_receive(radio, &buf, len);
-    sscanf(buf, "N=%d;V=%d;T=%d",&node,&volt,&temp);
-    fprintf(stderr, "[rf24 pong callback] Node %d, payload %s, temperature %f, voltage: %f\n", node, buf, (float) (temp / 100.0), (float) (volt / 100.0));
-    post_data(node, (float) (temp / 100.0), (float) (volt / 100.0));
+
+  memcpy(buf, frame->data, frame->len);
+  buf[frame->len] = '\0';
+
+  if (sscanf(buf, "N=%d;V=%d;T=%d", &node, &volt, &temp) != 3) {
+    fprintf(stderr, "[rf24 pong] Pipe %d, unknown payload %s\n", frame->pipe, buf);
+    return;
   }
-  rf24_reset_status(radio);
+
+  fprintf(stderr, "[rf24 pong] Node %d, payload %s, temperature %f, voltage: %f\n", node, buf, (float) (temp / 100.0), (float) (volt / 100.0));
+  post_data(node, (float) (temp / 100.0), (float) (volt / 100.0));
+}
+
+/* services the radio: every IRQ empties the RX FIFO into the ring */
+void * radio_thread(void * data)
+{
+  rf24_irq_poll((rf24_t *) data, NULL);
+  return NULL;
 }
 
 int main(void)
 {
   rf24_t radio;
+  rf24_ring_t ring;
+  rf24_frame_t frame;
+  pthread_t thread;
+  uint32_t dropped = 0;
+
   curl_global_init(CURL_GLOBAL_DEFAULT);
 
   uint64_t pipe_addresses[3] = { 0xF0F0F0F0D2LL, 0xF0F0F0F0E1LL, 0xF0F0F0F0A2LL };
@@ -84,9 +86,24 @@ int main(void)
   rf24_open_reading_pipe(&radio, 1, pipe_addresses[1]);
   rf24_open_reading_pipe(&radio, 2, pipe_addresses[2]);
 
+  /* posting over HTTP is slow, it runs here while the radio thread keeps the FIFO empty */
+  rf24_ring_init(&ring, 64);
+  rf24_set_rx_ring(&radio, &ring);
+
   rf24_start_listening(&radio);
   rf24_dump(&radio);
-  rf24_irq_poll(&radio, &send_pong);
+  pthread_create(&thread, NULL, radio_thread, &radio);
+
+  while (1) {
+    while (rf24_ring_pop(&ring, &frame) == 0) {
+      post_frame(&frame);
+    }
+    if (ring.dropped != dropped) {
+      fprintf(stderr, "[rf24 pong] %d frames dropped, ring full\n", ring.dropped - dropped);
+      dropped = ring.dropped;
+    }
+    usleep(10000);
+  }
 
   return 0;
 }
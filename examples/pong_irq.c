@@ -7,35 +7,23 @@
 
 void send_pong(void * data)
 {
-  char buf[32];
-  uint8_t i, len, done;
+  rf24_frame_t frames[RF24_RX_FIFO_DEPTH];
   rf24_t * radio = (rf24_t *) data;
+  int8_t i, count;
 
-  rf24_sync_status(radio);
+  /* clear the flags first, receive_all() then picks up everything in the FIFO, also what arrives meanwhile */
+  rf24_reset_status(radio);
+  count = rf24_receive_all(radio, frames, RF24_RX_FIFO_DEPTH);
 
-  fprintf(stderr, "[rf24 pong callback] Got IRQ on pin %d. TX ok: %d, TX fail: %d RX ready: %d RX_LEN: %d PIPE: %d\n",
-      radio->irq_pin,
-      radio->status.tx_ok,
-      radio->status.tx_fail_retries,
-      radio->status.rx_data_available,
-      radio->status.rx_data_len,
-      radio->status.rx_data_pipe
-      );
+  fprintf(stderr, "[rf24 pong callback] Got IRQ on pin %d, %d payloads\n", radio->irq_pin, count);
 
-  if (radio->status.rx_data_available) {
-    len = radio->status.rx_data_len;
-
-    rf24_receive(radio, &buf, len);
-    usleep(20);
-    rf24_reset_status(radio);
-
-    fprintf(stderr, "[rf24 pong callback] Data len: %d, data: %s\n", len, buf);
+  for (i = 0; i < count; i++) {
+    fprintf(stderr, "[rf24 pong callback] Pipe: %d, data len: %d, data: %.*s\n",
+        frames[i].pipe, frames[i].len, frames[i].len, frames[i].data);
 
     rf24_stop_listening(radio);
-    rf24_send(radio, &buf, 8 * sizeof(uint8_t));
+    rf24_send(radio, frames[i].data, 8 * sizeof(uint8_t));
     rf24_start_listening(radio);
-  } else {
-    rf24_reset_status(radio);
   }
 }
 
@@ -15,8 +15,40 @@
 #define GPIO_ACTIVE_HIGH  0
 #define GPIO_ACTIVE_LOW   1
 
+#define GPIO_BACKEND_SYSFS 0
+#define GPIO_BACKEND_CDEV  1
+#define GPIO_BACKEND_MMIO  2
+
+/* BCM283x GPIO function select values */
+#define GPIO_FSEL_INPUT  0
+#define GPIO_FSEL_OUTPUT 1
+
 #include <inttypes.h>
 
+/* Pin kept open for the lifetime of its user. With the sysfs backend fd is
+ * the value file and a write is a single pwrite(), with the character device
+ * backend fd is a line request and a write is a single ioctl. Memory mapped
+ * lines have no fd, a write is a store to the set/clear register at base.
+ */
+struct gpio_line {
+  int32_t  fd;
+  uint8_t  pin, backend;
+  uint32_t seqno, missed;
+  volatile uint32_t * base;
+};
+
+typedef struct gpio_line gpio_line_t;
+
+/* Edge seen on an input line. timestamp_ns is CLOCK_MONOTONIC; the character
+ * device backend reports the kernel's edge timestamp, sysfs the time it was read.
+ */
+struct gpio_event {
+  uint64_t timestamp_ns;
+  uint32_t seqno;
+};
+
+typedef struct gpio_event gpio_event_t;
+
 uint8_t gpio_export(uint8_t gpio_pin);
 uint8_t gpio_export_wait(uint8_t gpio_pin);
 uint8_t gpio_unexport(uint8_t gpio_pin);
@@ -28,6 +60,30 @@ uint8_t gpio_set_edge(uint8_t gpio_pin, uint8_t gpio_edge);
 uint8_t gpio_read(uint8_t gpio_pin);
 uint8_t gpio_write(uint8_t gpio_ping, uint8_t gpio_value);
 
+uint8_t gpio_use_chip(const char * chip);
+
+uint8_t gpio_line_open(gpio_line_t * line, uint8_t gpio_pin, uint8_t gpio_direction);
+uint8_t gpio_line_open_edge(gpio_line_t * line, uint8_t gpio_pin, uint8_t gpio_edge);
+uint8_t gpio_line_close(gpio_line_t * line);
+uint8_t gpio_line_read(gpio_line_t * line);
+uint8_t gpio_line_write(gpio_line_t * line, uint8_t gpio_value);
+uint8_t gpio_line_read_event(gpio_line_t * line, gpio_event_t * event);
+
+uint8_t gpio_cdev_line_open(gpio_line_t * line, const char * chip, uint8_t gpio_pin, uint8_t gpio_direction, uint8_t gpio_edge);
+uint8_t gpio_cdev_line_read(gpio_line_t * line);
+uint8_t gpio_cdev_line_write(gpio_line_t * line, uint8_t gpio_value);
+uint8_t gpio_cdev_line_read_event(gpio_line_t * line, gpio_event_t * event);
+
+uint8_t gpio_use_mmio(const char * dev);
+void    gpio_delay_us(uint32_t us);
+
+void    gpio_mmio_set_function(volatile uint32_t * base, uint8_t gpio_pin, uint8_t function);
+void    gpio_mmio_write(volatile uint32_t * base, uint8_t gpio_pin, uint8_t gpio_value);
+uint8_t gpio_mmio_read(volatile uint32_t * base, uint8_t gpio_pin);
+volatile uint32_t * gpio_mmio_base(void);
+volatile uint32_t * gpio_mmio_acquire(void);
+void    gpio_mmio_release(void);
+
 uint8_t gpio_poll(uint8_t gpio_pin, uint8_t gpio_edge, void(* callback)(void * arg), void * arg);
 #endif
 // vim:ai:cin:et:sts=2 sw=2 ft=c
@@ -107,6 +107,7 @@
 #define R_RX_PAYLOAD  0x61
 #define W_TX_PAYLOAD  0xA0
 #define W_ACK_PAYLOAD 0xA8
+#define W_TX_PAYLOAD_NOACK 0xB0
 #define FLUSH_TX      0xE1
 #define FLUSH_RX      0xE2
 #define REUSE_TX_PL   0xE3
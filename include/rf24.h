@@ -2,6 +2,9 @@
 #define __RF24_H__
 
 #include <inttypes.h>
+#include <sys/uio.h>
+#include "spi.h"
+#include "gpio.h"
 
 /* CRC settings */
 #define RF24_CRC_DISABLED 0
@@ -19,19 +22,229 @@
 #define RF24_1MBPS    1
 #define RF24_2MBPS    2
 
+/* largest payload the chip accepts */
+#define RF24_MAX_PAYLOAD 32
+
+/* payloads the TX FIFO holds, and so sends that can be in flight at once */
+#define RF24_TX_FIFO_DEPTH 3
+
+/* payloads the RX FIFO holds */
+#define RF24_RX_FIFO_DEPTH 3
+
+/* settling time from standby to TX or RX mode (Tstdby2a), in us */
+#define RF24_TSTDBY2A_US 130
+
+/* turnaround an ack takes beyond Tstdby2a and its frame before the sender
+ * has it, in us; fitted to the datasheet's table of ack payloads per ARD,
+ * which the frame time alone already matches at 1Mbps
+ */
+#define RF24_ACK_TURNAROUND_2MBPS_US   20
+#define RF24_ACK_TURNAROUND_250KBPS_US 48
+
+/* time rf24_send() waits beyond the modelled MAX_RT, for IRQ and scheduling latency, in us */
+#define RF24_TX_SLACK_US 5000
+
+/* size of the register map, up to and including FEATURE */
+#define RF24_REGISTER_COUNT 0x1E
+
 /* SPI device names */
 #define RF24_SPI_DEV_0 "/dev/spidev0.0"
 #define RF24_SPI_DEV_1 "/dev/spidev0.1"
 
+/* payload slots a radio hands out through rf24_receive_views() */
+#define RF24_RX_SLOTS 8
+
+/* ack payloads rf24_queue_ack_payload() holds per pipe */
+#define RF24_ACK_QUEUE_DEPTH 8
+
+/* ack payloads rf24_post_ack_payload() hands over ahead of the servicing thread, a power of two */
+#define RF24_ACK_POST_DEPTH 16
+
+/* most segments rf24_sendv() and rf24_send_ackv() take */
+#define RF24_MAX_SEGMENTS 8
+
+/* csn_pin value meaning chip select is driven by the SPI controller */
+#define RF24_CSN_HW 0xFF
+
+/* number of buckets in a latency histogram */
+#define RF24_HISTOGRAM_BUCKETS 24
+
+/* Log2 histogram of durations: bucket 0 counts the ones under 1us, bucket n
+ * the ones in [2^(n-1), 2^n) us, the last bucket everything longer.
+ */
+struct rf24_histogram {
+  uint32_t buckets[RF24_HISTOGRAM_BUCKETS];
+  uint32_t count, max_us;
+};
+
+typedef struct rf24_histogram rf24_histogram_t;
+
+/* Operation counters of a radio. They are bumped in place by the calls doing
+ * the work, without locks, and wrap around; read them with rf24_get_stats().
+ * spi_messages counts transport transfers, one SPI_IOC_MESSAGE ioctl each on
+ * spidev, gpio_writes the CE and CSN changes. rx_fifo_full counts the reads
+ * that found all three RX FIFO slots taken, which only the batched reads
+ * (rf24_receive_all(), rf24_receive_views(), the RX ring) can tell.
+ */
+struct rf24_stats {
+  uint32_t spi_transactions, spi_messages, gpio_writes;
+  /* IRQs serviced, and IRQ edges lost before they could be read */
+  uint32_t irqs, irq_missed;
+  uint32_t tx_ok, tx_max_rt, tx_timeouts, tx_fifo_full, tx_resends;
+  uint32_t rx_payloads, rx_fifo_full, rx_invalid;
+  /* ack payloads queued, written to the chip, dropped on expiry and refused or pushed out by a full queue */
+  uint32_t ack_queued, ack_loaded, ack_expired, ack_dropped;
+  /* from the CE pulse to TX_DS or MAX_RT being seen */
+  rf24_histogram_t send_latency;
+  /* from the IRQ line asserting to the callback being called */
+  rf24_histogram_t irq_latency;
+  /* from the IRQ edge announcing a payload to the SPI read of it finishing */
+  rf24_histogram_t rx_latency;
+};
+
+typedef struct rf24_stats rf24_stats_t;
+
+/* Hardware access used by a radio.
+ *
+ * transfer() clocks out count transfers of msg starting at first. Every
+ * nRF24 command gets its own chip select frame, which runs up to and
+ * including the next transfer with cs_change set (or the last one); most
+ * commands are a single transfer. When csn is set, CSN is driven by the radio
+ * around each command and transfer() is only ever handed the transfers of a
+ * single one; when it is NULL, transfer() frames the commands itself and gets
+ * whole transactions at once.
+ * ce() drives the CE line.
+ * irq_wait() blocks until the IRQ line is asserted, for at most timeout_ms
+ * (forever when negative); returns 1 when asserted, 0 on timeout, -1 on error.
+ * When asserted, timestamp_ns is set to the CLOCK_MONOTONIC time the line was
+ * seen going low, as close to the edge as the implementation can tell.
+ * irq_fd() is optional: it returns a descriptor that polls ready with events
+ * (POLLIN or POLLPRI, the same bits as their EPOLL counterparts) when the IRQ
+ * line may have been asserted, -1 when there is none. irq_wait() with a zero
+ * timeout consumes what made it ready.
+ */
+struct rf24_transport {
+  int8_t (* transfer)(void * ctx, spi_msg_t * msg, uint8_t first, uint8_t count);
+  void   (* csn)(void * ctx, uint8_t level);
+  void   (* ce)(void * ctx, uint8_t level);
+  int8_t (* irq_wait)(void * ctx, int32_t timeout_ms, uint64_t * timestamp_ns);
+  int32_t (* irq_fd)(void * ctx, uint32_t * events);
+};
+
+typedef struct rf24_transport rf24_transport_t;
+
+/* A payload read from the RX FIFO. edge_ns is the CLOCK_MONOTONIC time of the
+ * IRQ edge that announced it, as reported by the transport (0 when it was read
+ * without an IRQ having been seen), timestamp_ns the time the SPI read finished.
+ */
+struct rf24_frame {
+  uint64_t edge_ns, timestamp_ns;
+  uint8_t pipe, len;
+  uint8_t data[RF24_MAX_PAYLOAD];
+};
+
+typedef struct rf24_frame rf24_frame_t;
+
+/* A payload left where SPI clocked it in, in one of the radio's slots. data
+ * stays valid until the view is handed back with rf24_release_view(); the
+ * other fields are as in rf24_frame_t.
+ */
+struct rf24_rx_view {
+  const uint8_t * data;
+  uint64_t edge_ns, timestamp_ns;
+  uint8_t pipe, len, slot;
+};
+
+typedef struct rf24_rx_view rf24_rx_view_t;
+
+/* STATUS followed by the payload, as read by R_RX_PAYLOAD */
+struct rf24_rx_slot {
+  uint8_t raw[1 + RF24_MAX_PAYLOAD];
+};
+
+/* An ack payload waiting in a pipe's queue. expires_ns is 0 for one that
+ * never expires, seq keeps the ones of equal priority in order.
+ */
+struct rf24_ack_entry {
+  uint64_t expires_ns;
+  uint32_t seq;
+  uint8_t priority, len;
+  uint8_t data[RF24_MAX_PAYLOAD];
+};
+
+/* in_chip is how many of the pipe's payloads the TX FIFO holds as far as the
+ * library can tell, loaded a copy of the last one written there
+ */
+struct rf24_ack_queue {
+  struct rf24_ack_entry entries[RF24_ACK_QUEUE_DEPTH];
+  struct rf24_ack_entry loaded;
+  uint8_t count, in_chip;
+};
+
+/* An ack payload posted by another thread, on its way to the pipe's queue */
+struct rf24_ack_post {
+  uint64_t expires_ns;
+  uint8_t pipe, priority, len;
+  uint8_t data[RF24_MAX_PAYLOAD];
+};
+
+struct rf24;
+struct rf24_ring;
+
+/* Completion of an rf24_send_async(): tx_ok is 1 when the payload was acked
+ * (or sent, without auto-ack), 0 when it hit MAX_RT.
+ */
+typedef void (* rf24_send_callback_t)(struct rf24 * radio, uint8_t tx_ok, void * ctx);
+
+/* A payload written to the TX FIFO and waiting for TX_DS or MAX_RT. The data
+ * is kept so the payloads queued behind a failed one can be written again.
+ */
+struct rf24_tx_slot {
+  rf24_send_callback_t callback;
+  void * ctx;
+  /* W_TX_PAYLOAD, or W_TX_PAYLOAD_NOACK for a payload that wants no ack */
+  uint8_t reg, len;
+  uint8_t data[RF24_MAX_PAYLOAD];
+};
+
 struct rf24 {
   struct {
     uint8_t tx_ok, tx_fail_retries;
     uint8_t rx_data_available, rx_dyn_data_len, rx_data_len, rx_data_pipe;
+    /* IRQ edge and read completion of the last payload taken by rf24_receive(), see rf24_frame_t */
+    uint64_t rx_edge_ns, rx_read_ns;
   } status;
   uint64_t pipe0_address;
-  uint32_t spi, tx_timeout;
+  spi_t spi;
+  uint32_t tx_timeout;
   uint8_t csn_pin, ce_pin, irq_pin;
+  gpio_line_t csn_line, ce_line, irq_line;
+  const rf24_transport_t * transport;
+  void * transport_ctx;
   uint8_t ack_payload_enabled, p_variant, dynamic_payloads_enabled, payload_size;
+  /* write-through copy of the configuration registers, indexed by register address */
+  uint8_t regs[RF24_REGISTER_COUNT];
+  rf24_stats_t stats;
+  /* asynchronous sends in TX FIFO order, tx_started is when the first one was put on the air */
+  struct rf24_tx_slot tx_slots[RF24_TX_FIFO_DEPTH];
+  uint8_t tx_head, tx_count;
+  uint64_t tx_started;
+  /* CE held high by rf24_stream_write(); MAX_RT rounds a payload gets, and the ones the current head had */
+  uint8_t tx_streaming, tx_resend, tx_max_rt_run;
+  /* where the IRQ path puts received frames, see rf24_set_rx_ring() */
+  struct rf24_ring * rx_ring;
+  /* payload slots for rf24_receive_views(), a set bit in rx_slots_used marks one handed out */
+  struct rf24_rx_slot rx_slots[RF24_RX_SLOTS];
+  uint32_t rx_slots_used;
+  /* edge of the last IRQ seen, stamped on the payloads read until the RX FIFO is next found empty */
+  uint64_t irq_ns;
+  /* ack payloads waiting per pipe, see rf24_queue_ack_payload(); ack_next is where the next refill starts looking */
+  struct rf24_ack_queue ack_queues[6];
+  uint32_t ack_seq;
+  uint8_t ack_next;
+  /* rf24_post_ack_payload()'s ring, head written by the posting thread and tail by the servicing one */
+  struct rf24_ack_post ack_posts[RF24_ACK_POST_DEPTH];
+  uint32_t ack_post_head, ack_post_tail;
 };
 
 typedef struct rf24 rf24_t;
@@ -40,33 +253,58 @@ rf24_t * rf24_new(char * spi_dev, uint8_t ce_pin, uint8_t irq_pin);
 uint8_t  rf24_delete(rf24_t * this);
 
 uint8_t rf24_initialize(rf24_t * this, char * spi_dev, uint8_t ce_pin, uint8_t irq_pin);
+uint8_t rf24_initialize_csn(rf24_t * this, char * spi_dev, uint8_t ce_pin, uint8_t irq_pin, uint8_t csn_pin);
+uint8_t rf24_initialize_transport(rf24_t * this, const rf24_transport_t * transport, void * ctx);
 void rf24_dump(rf24_t * this);
 
 void rf24_power_up(rf24_t * this);
 void rf24_power_down(rf24_t * this);
 void rf24_reset(rf24_t * this);
+void rf24_resync(rf24_t * this);
+uint8_t rf24_verify(rf24_t * this);
 
 void rf24_start_listening(rf24_t * this);
 void rf24_stop_listening(rf24_t * this);
 
 uint8_t rf24_send(rf24_t * this, void * buf, uint8_t len);
+uint8_t rf24_sendv(rf24_t * this, const struct iovec * iov, uint8_t iovcnt);
+int8_t rf24_send_async(rf24_t * this, void * buf, uint8_t len, rf24_send_callback_t callback, void * ctx);
+uint8_t rf24_handle_tx_irq(rf24_t * this);
+int8_t rf24_stream_write(rf24_t * this, void * buf, uint8_t len, rf24_send_callback_t callback, void * ctx);
+int8_t rf24_stream_write_noack(rf24_t * this, void * buf, uint8_t len, rf24_send_callback_t callback, void * ctx);
+int8_t rf24_stream_end(rf24_t * this, int32_t timeout_ms);
+int32_t rf24_send_burst(rf24_t * this, void * payloads, uint8_t len, uint32_t count);
 uint8_t rf24_receive(rf24_t * this, void * buf, uint8_t len);
+int8_t rf24_receive_all(rf24_t * this, rf24_frame_t * frames, uint8_t max);
+int8_t rf24_receive_views(rf24_t * this, rf24_rx_view_t * views, uint8_t max);
+void rf24_release_view(rf24_t * this, const rf24_rx_view_t * view);
+void rf24_set_rx_ring(rf24_t * this, struct rf24_ring * ring);
 
 void rf24_open_reading_pipe(rf24_t * this, uint8_t pipe, uint64_t address);
+void rf24_set_reading_pipes(rf24_t * this, uint8_t mask, const uint64_t * addresses, uint8_t close_mask);
 void rf24_open_writing_pipe(rf24_t * this, uint64_t address);
 
 void rf24_send_ack_on_pipe(rf24_t * this, uint8_t pipe_no, void * buf, uint8_t len);
+void rf24_send_ackv(rf24_t * this, uint8_t pipe_no, const struct iovec * iov, uint8_t iovcnt);
+void rf24_replace_ack_payload(rf24_t * this, uint8_t pipe_no, void * buf, uint8_t len);
+int8_t rf24_queue_ack_payload(rf24_t * this, uint8_t pipe_no, const void * buf, uint8_t len, uint8_t priority, uint32_t ttl_ms);
+int8_t rf24_post_ack_payload(rf24_t * this, uint8_t pipe_no, const void * buf, uint8_t len, uint8_t priority, uint32_t ttl_ms);
+uint8_t rf24_ack_queue_pending(rf24_t * this, uint8_t pipe_no);
+void rf24_clear_ack_queue(rf24_t * this, uint8_t pipe_no);
+void rf24_clear_ack_queues(rf24_t * this, uint8_t mask);
 
 uint8_t rf24_data_available(rf24_t * this);
 uint8_t rf24_data_available_on_pipe(rf24_t * this, uint8_t * pipe_number);
 
 void rf24_enable_dynamic_payloads(rf24_t * this);
 void rf24_enable_ack_payload(rf24_t * this);
+void rf24_enable_dynamic_ack(rf24_t * this);
 void rf24_disable_crc(rf24_t * this);
 
 void rf24_set_crc_length(rf24_t * this, uint8_t crc_length);
 void rf24_set_pa_level(rf24_t * this, uint8_t pa_level);
 void rf24_set_retries(rf24_t * this, uint8_t delay, uint8_t count);
+void rf24_set_tx_resend(rf24_t * this, uint8_t count);
 void rf24_set_autoack(rf24_t * this, uint8_t autoack);
 void rf24_set_autoack_for_pipe(rf24_t * this, uint8_t pipe, uint8_t autoack);
 void rf24_set_data_rate(rf24_t * this, uint8_t speed);
@@ -78,7 +316,22 @@ uint8_t rf24_get_dynamic_payload_size(rf24_t * this);
 uint8_t rf24_get_crc_length(rf24_t * this);
 
 void rf24_poll(rf24_t * this, void(* callback)(rf24_t * radio));
+void rf24_irq_poll(rf24_t * this, void(* callback)(void * radio));
+int8_t rf24_irq_wait(rf24_t * this, int32_t timeout_ms);
+int32_t rf24_get_irq_fd(rf24_t * this, uint32_t * events);
+int16_t rf24_process(rf24_t * this, uint8_t max_events);
+void rf24_service_irq(rf24_t * this, uint64_t timestamp_ns, void(* callback)(void * radio));
 void rf24_sync_status(rf24_t * this);
 void rf24_reset_status(rf24_t * this);
+
+uint32_t rf24_airtime_us(rf24_t * this, uint8_t len);
+uint32_t rf24_send_time_us(rf24_t * this, uint8_t len);
+uint32_t rf24_max_rt_time_us(rf24_t * this, uint8_t len);
+int8_t rf24_max_ack_payload(rf24_t * this);
+
+void rf24_get_stats(rf24_t * this, rf24_stats_t * stats);
+void rf24_reset_stats(rf24_t * this);
+void rf24_histogram_add(rf24_histogram_t * histogram, uint64_t ns);
+uint64_t rf24_now_ns(void);
 #endif
 // vim:ai:cin:et:sts=2 sw=2 ft=c
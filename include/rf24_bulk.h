@@ -0,0 +1,92 @@
+#ifndef __RF24_BULK_H__
+#define __RF24_BULK_H__
+
+#include <inttypes.h>
+#include "rf24.h"
+
+/* Every frame starts with its type in the high nibble of the first byte and
+ * the transfer id in the low one, followed by a little endian 16 bit number:
+ * the frame's sequence number for DATA, the transfer's frame count for POLL,
+ * the first frame still missing for ACK.
+ */
+#define RF24_BULK_HEADER 3
+#define RF24_BULK_CHUNK  (RF24_MAX_PAYLOAD - RF24_BULK_HEADER)
+
+#define RF24_BULK_DATA 0x10
+#define RF24_BULK_POLL 0x20
+#define RF24_BULK_ACK  0x30
+
+/* ACK adds a 32 bit bitmap of the frames received from the first missing one
+ * on and the number of frames up to the last one seen
+ */
+#define RF24_BULK_POLL_LEN RF24_BULK_HEADER
+#define RF24_BULK_ACK_LEN  (RF24_BULK_HEADER + 6)
+
+/* frames a window may hold, one bit each in the ACK bitmap */
+#define RF24_BULK_MAX_WINDOW 32
+
+/* most frames in one transfer */
+#define RF24_BULK_MAX_FRAMES 0xFFFF
+
+/* polls, and windows in a row without progress, rf24_bulk_send() allows before giving up */
+#define RF24_BULK_RETRIES 32
+
+/* wait before polling again when a poll was not acked, the receiver's RX FIFO may be full, in us */
+#define RF24_BULK_POLL_DELAY_US 100
+
+struct rf24_bulk_stats {
+  uint32_t frames, retransmits, windows, polls;
+};
+
+typedef struct rf24_bulk_stats rf24_bulk_stats_t;
+
+/* Sending side of a windowed bulk transfer.
+ *
+ * A window of up to window frames is streamed with W_TX_PAYLOAD_NOACK and CE
+ * held high, so the frames go out back to back without waiting for acks.
+ * Then an acked POLL asks the receiver where it stands; the answer comes back
+ * as the ack payload of a POLL, and only the frames it reports missing are
+ * sent again in the next window, together with the new ones. The answer may
+ * lag behind the frames just sent, those past the last one it saw are only
+ * sent again when a poll in between shows no progress.
+ *
+ * Both radios need dynamic payloads and ack payloads enabled; the sender
+ * turns on dynamic acks itself.
+ */
+struct rf24_bulk_tx {
+  rf24_t * radio;
+  uint8_t window, id;
+  rf24_bulk_stats_t stats;
+};
+
+typedef struct rf24_bulk_tx rf24_bulk_tx_t;
+
+/* Receiving side: frames are put in place in buf. got has a bit for each
+ * frame from next on that is already in; total is 0 until the first POLL
+ * told it. rf24_bulk_rx_ack() refreshes the ack payload once the frames read
+ * in one go went through rf24_bulk_rx_input(), so a POLL gets an answer as
+ * of the last batch drained before it.
+ *
+ * The chip raises TX_DS for every ack payload it sends, whoever services the
+ * receiver's IRQ has to clear it or the line stays asserted.
+ */
+struct rf24_bulk_rx {
+  uint8_t * buf;
+  uint32_t max_len, len;
+  uint8_t id, active, complete, pipe, ack_pending;
+  uint16_t next, total, seen;
+  uint32_t got;
+  uint32_t frames, duplicates;
+};
+
+typedef struct rf24_bulk_rx rf24_bulk_rx_t;
+
+int8_t rf24_bulk_tx_init(rf24_bulk_tx_t * tx, rf24_t * radio, uint8_t window);
+int8_t rf24_bulk_send(rf24_bulk_tx_t * tx, const void * buf, uint32_t len);
+
+void   rf24_bulk_rx_init(rf24_bulk_rx_t * rx, void * buf, uint32_t max_len);
+int8_t rf24_bulk_rx_input(rf24_bulk_rx_t * rx, uint8_t pipe, const uint8_t * data, uint8_t len);
+void   rf24_bulk_rx_ack(rf24_bulk_rx_t * rx, rf24_t * radio);
+
+#endif
+// vim:ai:cin:et:sts=2 sw=2 ft=c
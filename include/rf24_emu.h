@@ -0,0 +1,74 @@
+#ifndef __RF24_EMU_H__
+#define __RF24_EMU_H__
+
+#include <inttypes.h>
+#include <pthread.h>
+#include "rf24.h"
+
+#define RF24_EMU_FIFO_DEPTH 3
+#define RF24_EMU_MAX_RADIOS 8
+#define RF24_EMU_ADDR_WIDTH 5
+
+/* Software nRF24L01+ for running the library without hardware.
+ *
+ * An rf24_emu_t models the register map, the 3 deep TX and RX FIFOs, STATUS
+ * and the IRQ line, auto-ack with retransmits and ack payloads. Emulated
+ * radios attached to the same rf24_emu_air_t hear each other when they share
+ * channel, data rate and address. Air time is not modelled: a transmission
+ * completes (acked, or failed after ARC retries) the moment CE allows it.
+ *
+ * Pass &rf24_emu_transport and the rf24_emu_t to rf24_initialize_transport().
+ * All emulators on one air share its lock, so radios may be driven from
+ * different threads.
+ */
+
+struct rf24_emu_air;
+
+struct rf24_emu_payload {
+  uint8_t data[RF24_MAX_PAYLOAD];
+  uint8_t len, pipe, ack, noack, pid;
+};
+
+struct rf24_emu {
+  struct rf24_emu_air * air;
+  uint8_t regs[RF24_REGISTER_COUNT];
+  uint8_t rx_addr[2][RF24_EMU_ADDR_WIDTH], tx_addr[RF24_EMU_ADDR_WIDTH];
+  struct rf24_emu_payload tx_fifo[RF24_EMU_FIFO_DEPTH], rx_fifo[RF24_EMU_FIFO_DEPTH];
+  uint8_t tx_count, rx_count;
+  uint8_t irq, ce, reuse, pid;
+  /* CLOCK_MONOTONIC time the IRQ line last went low, eventfd signalled with it */
+  uint64_t irq_ns;
+  int32_t event_fd;
+  /* pid and CRC of the last frame per pipe, to drop retransmits of it */
+  uint8_t last_pid[6];
+  uint16_t last_sum[6];
+  struct {
+    uint32_t tx_packets, tx_retries, tx_failed, rx_packets, rx_dropped;
+  } stats;
+};
+
+typedef struct rf24_emu rf24_emu_t;
+
+struct rf24_emu_air {
+  struct rf24_emu * radios[RF24_EMU_MAX_RADIOS];
+  uint8_t  count;
+  /* per mille of frames (and acks) lost on the way */
+  uint16_t loss;
+  uint32_t seed;
+  pthread_mutex_t lock;
+  pthread_cond_t  irq;
+};
+
+typedef struct rf24_emu_air rf24_emu_air_t;
+
+extern const rf24_transport_t rf24_emu_transport;
+
+void   rf24_emu_air_init(rf24_emu_air_t * air, uint16_t loss);
+void   rf24_emu_air_destroy(rf24_emu_air_t * air);
+
+int8_t rf24_emu_init(rf24_emu_t * emu, rf24_emu_air_t * air);
+void   rf24_emu_destroy(rf24_emu_t * emu);
+uint8_t rf24_emu_irq(rf24_emu_t * emu);
+
+#endif
+// vim:ai:cin:et:sts=2 sw=2 ft=c
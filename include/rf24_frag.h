@@ -0,0 +1,89 @@
+#ifndef __RF24_FRAG_H__
+#define __RF24_FRAG_H__
+
+#include <inttypes.h>
+#include "rf24.h"
+
+/* Fragment header: message id, then 12 bits of fragment index and the flags
+ * in a little endian 16 bit word. The last fragment adds a byte with the
+ * length of its data, static payloads pad it. Every other fragment carries
+ * exactly fragment_size - RF24_FRAG_HEADER bytes.
+ */
+#define RF24_FRAG_HEADER      3
+#define RF24_FRAG_INDEX_MASK  0x0FFF
+#define RF24_FRAG_LAST        0x8000
+
+/* most fragments a message may be split into */
+#define RF24_FRAG_MAX_FRAGMENTS (RF24_FRAG_INDEX_MASK + 1)
+
+/* events reported to the callback */
+#define RF24_FRAG_COMPLETE 0
+#define RF24_FRAG_TIMEOUT  1
+
+/* A message being put back together. received counts distinct fragments,
+ * count is the number of fragments once the last one was seen and 0 before,
+ * top one past the highest index seen.
+ */
+struct rf24_frag_msg {
+  uint8_t  in_use, pipe, id;
+  uint16_t received, count, top;
+  uint32_t len;
+  uint64_t started_ns, updated_ns;
+  uint8_t  * data;
+  uint32_t * seen;
+};
+
+typedef struct rf24_frag_msg rf24_frag_msg_t;
+
+struct rf24_frag;
+
+/* Called with a complete message, whose data is msg->data, or with one that
+ * timed out, see rf24_frag_missing(). The slot is reused once it returns.
+ */
+typedef void (* rf24_frag_callback_t)(struct rf24_frag * frag, uint8_t event, const rf24_frag_msg_t * msg, void * ctx);
+
+struct rf24_frag_stats {
+  uint32_t sent, send_failed;
+  uint32_t completed, timeouts, duplicates, no_slot, invalid;
+};
+
+typedef struct rf24_frag_stats rf24_frag_stats_t;
+
+/* Splits messages larger than a payload into numbered fragments and puts them
+ * back together on the receiving side.
+ *
+ * Every reassembly slot, with room for a message of max_len bytes, is
+ * allocated by rf24_frag_init(); fragments are copied straight to their place
+ * in it and a bitmap tells which ones arrived, so nothing is allocated per
+ * fragment. Partial messages are told apart by pipe and message id, as many
+ * can be in progress as there are slots. Fragments of a message no slot is
+ * free for are dropped. A frag that only sends needs no slots.
+ */
+struct rf24_frag {
+  rf24_frag_msg_t * msgs;
+  uint8_t  slots, fragment_size, next_id;
+  uint32_t max_len, timeout_ms;
+  rf24_frag_callback_t callback;
+  void * ctx;
+  /* id of the last message completed per pipe and when, its fragments
+   * arriving again within timeout_ms are retransmits and dropped; later
+   * ones start a new message, the sender may have restarted its ids
+   */
+  uint8_t  last_id[6], last_valid[6];
+  uint64_t last_ns[6];
+  rf24_frag_stats_t stats;
+};
+
+typedef struct rf24_frag rf24_frag_t;
+
+int8_t   rf24_frag_init(rf24_frag_t * frag, uint8_t slots, uint32_t max_len, uint8_t fragment_size, uint32_t timeout_ms, rf24_frag_callback_t callback, void * ctx);
+void     rf24_frag_free(rf24_frag_t * frag);
+
+int8_t   rf24_frag_send(rf24_frag_t * frag, rf24_t * radio, const void * buf, uint32_t len);
+
+int8_t   rf24_frag_input(rf24_frag_t * frag, uint8_t pipe, const uint8_t * data, uint8_t len);
+uint8_t  rf24_frag_expire(rf24_frag_t * frag);
+uint16_t rf24_frag_missing(const rf24_frag_msg_t * msg, uint16_t * missing, uint16_t max);
+
+#endif
+// vim:ai:cin:et:sts=2 sw=2 ft=c
@@ -0,0 +1,46 @@
+#ifndef __RF24_GROUP_H__
+#define __RF24_GROUP_H__
+
+#include <inttypes.h>
+#include "rf24.h"
+
+#define RF24_GROUP_MAX_RADIOS 8
+
+/* IRQs rf24_process() gets to service per radio and wakeup, so one busy radio cannot starve the others */
+#define RF24_GROUP_MAX_EVENTS 8
+
+struct rf24_group;
+
+/* Called from rf24_group_poll() after a radio's pending IRQs were serviced */
+typedef void (* rf24_group_callback_t)(struct rf24_group * group, rf24_t * radio, void * ctx);
+
+/* Several radios serviced from one thread.
+ *
+ * The IRQ descriptors of all members sit in one epoll set; every wakeup runs
+ * rf24_process() on the radios that turned ready and then their callback.
+ * rf24_group_send_async() hands a payload to the member with the fewest
+ * sends in flight, so traffic spreads across the radios.
+ */
+struct rf24_group {
+  int32_t epfd;
+  uint8_t count, next;
+  struct {
+    rf24_t * radio;
+    rf24_group_callback_t callback;
+    void * ctx;
+  } members[RF24_GROUP_MAX_RADIOS];
+};
+
+typedef struct rf24_group rf24_group_t;
+
+int8_t rf24_group_init(rf24_group_t * group);
+void   rf24_group_destroy(rf24_group_t * group);
+
+int8_t rf24_group_add(rf24_group_t * group, rf24_t * radio, rf24_group_callback_t callback, void * ctx);
+int8_t rf24_group_remove(rf24_group_t * group, rf24_t * radio);
+
+int8_t rf24_group_poll(rf24_group_t * group, int32_t timeout_ms);
+int8_t rf24_group_send_async(rf24_group_t * group, void * buf, uint8_t len, rf24_send_callback_t callback, void * ctx);
+
+#endif
+// vim:ai:cin:et:sts=2 sw=2 ft=c
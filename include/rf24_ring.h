@@ -0,0 +1,38 @@
+#ifndef __RF24_RING_H__
+#define __RF24_RING_H__
+
+#include <inttypes.h>
+#include "rf24.h"
+
+/* size of a cache line, head and tail sit on their own to keep the two threads from sharing one */
+#define RF24_RING_CACHE_LINE 64
+
+/* Lock-free single producer, single consumer ring of received frames.
+ *
+ * The thread servicing the radio pushes, exactly one other thread pops.
+ * Neither side locks or makes system calls; head and tail are only ever
+ * written by their own side and published with release stores. A push into
+ * a full ring drops the frame: dropped counts the frames lost that way,
+ * overruns the times the ring ran full.
+ */
+struct rf24_ring {
+  rf24_frame_t * frames;
+  uint32_t mask;
+  uint32_t dropped, overruns;
+  uint8_t  full;
+  uint32_t head __attribute__((aligned(RF24_RING_CACHE_LINE)));
+  uint32_t tail __attribute__((aligned(RF24_RING_CACHE_LINE)));
+};
+
+typedef struct rf24_ring rf24_ring_t;
+
+int8_t   rf24_ring_init(rf24_ring_t * ring, uint32_t size);
+void     rf24_ring_free(rf24_ring_t * ring);
+
+int8_t   rf24_ring_push(rf24_ring_t * ring, const rf24_frame_t * frame);
+int8_t   rf24_ring_pop(rf24_ring_t * ring, rf24_frame_t * frame);
+uint32_t rf24_ring_count(rf24_ring_t * ring);
+void     rf24_ring_prefault(rf24_ring_t * ring);
+
+#endif
+// vim:ai:cin:et:sts=2 sw=2 ft=c
@@ -0,0 +1,87 @@
+#ifndef __RF24_SCHED_H__
+#define __RF24_SCHED_H__
+
+#include <inttypes.h>
+#include "rf24.h"
+
+/* Nodes on the shared address start every payload with their id, little endian */
+#define RF24_SCHED_ID_LEN 2
+
+/* pipes the rotation hands out, 2-5; pipe 0 is the radio's own for sending and pipe 1 the shared address */
+#define RF24_SCHED_FIRST_PIPE 2
+#define RF24_SCHED_PIPES      4
+
+/* node has no pipe of its own */
+#define RF24_SCHED_NO_PIPE 0xFF
+
+/* A node known to the scheduler. shared nodes send on the shared address and
+ * are told apart by the id their payloads start with, the others have an
+ * address of their own and get a pipe while their turn lasts.
+ */
+struct rf24_sched_node {
+  uint16_t id;
+  uint8_t  shared, pipe;
+  uint64_t address;
+  uint64_t last_seen_ns;
+  uint32_t frames;
+  void * ctx;
+};
+
+typedef struct rf24_sched_node rf24_sched_node_t;
+
+struct rf24_sched;
+
+/* Called for every payload from a registered node; frame->data still starts with the id for shared nodes */
+typedef void (* rf24_sched_callback_t)(struct rf24_sched * sched, rf24_sched_node_t * node, const rf24_frame_t * frame, void * ctx);
+
+struct rf24_sched_stats {
+  uint32_t frames, unknown, rotations, pipe_writes;
+};
+
+typedef struct rf24_sched_stats rf24_sched_stats_t;
+
+/* Serves more nodes than the radio has pipes.
+ *
+ * Pipe 1 listens on the shared address, where any number of nodes send with
+ * their id in front of the payload. Nodes with an address of their own share
+ * its upper four bytes and differ in the low one; they take turns on pipes
+ * 2-5, a window of window_ms at a time, so each one is listened to for one
+ * window per cycle of rf24_sched_cycle_ms(). Its retransmits have to cover
+ * the rest of the cycle, that is the latency a rotated node adds.
+ *
+ * The registry is an array sorted by id, allocated by rf24_sched_init(). The
+ * pipes changing hands at a rotation are rewritten in one SPI message, after
+ * the RX FIFO was drained so no payload gets credited to the next node. Ack
+ * payloads for a pipe are dropped when it changes hands, one already in the
+ * chip included.
+ */
+struct rf24_sched {
+  rf24_t * radio;
+  rf24_sched_node_t * nodes;
+  uint16_t count, max_nodes, rotated, cursor;
+  uint64_t shared_address;
+  uint32_t window_ms;
+  uint64_t window_started_ns;
+  /* id of the node on each rotated pipe, valid where the bit in pipes_used is set */
+  uint16_t pipe_ids[RF24_SCHED_PIPES];
+  uint8_t  pipes_used;
+  rf24_sched_callback_t callback;
+  void * ctx;
+  rf24_sched_stats_t stats;
+};
+
+typedef struct rf24_sched rf24_sched_t;
+
+int8_t  rf24_sched_init(rf24_sched_t * sched, rf24_t * radio, uint16_t max_nodes, uint64_t shared_address, uint32_t window_ms, rf24_sched_callback_t callback, void * ctx);
+void    rf24_sched_free(rf24_sched_t * sched);
+
+int8_t  rf24_sched_add(rf24_sched_t * sched, uint16_t id, uint64_t address, void * ctx);
+int8_t  rf24_sched_remove(rf24_sched_t * sched, uint16_t id);
+rf24_sched_node_t * rf24_sched_find(rf24_sched_t * sched, uint16_t id);
+
+int32_t rf24_sched_run(rf24_sched_t * sched);
+void    rf24_sched_rotate(rf24_sched_t * sched);
+uint32_t rf24_sched_cycle_ms(rf24_sched_t * sched);
+
+#endif
+// vim:ai:cin:et:sts=2 sw=2 ft=c
@@ -0,0 +1,63 @@
+#ifndef __RF24_THREAD_H__
+#define __RF24_THREAD_H__
+
+#include <inttypes.h>
+#include <pthread.h>
+#include "rf24.h"
+
+/* how long the service thread sleeps on the IRQ line before looking at its stop flag */
+#define RF24_THREAD_STOP_POLL_MS 100
+
+/* stack the service thread gets on top of prefault_stack, for the loop and the callback */
+#define RF24_THREAD_STACK_MARGIN (64 * 1024)
+
+/* How the service thread runs.
+ *
+ * priority is the SCHED_FIFO priority (1-99), 0 leaves the thread on the
+ * default time-sharing policy. cpu pins it to one CPU, -1 lets it float.
+ * lock_memory calls mlockall() so neither the code nor the radio's buffers
+ * get paged out; prefault_stack is the number of stack bytes touched before
+ * the loop starts, so the first IRQs do not take page faults. The free RX
+ * slots and the free frames of the RX ring, set with rf24_set_rx_ring()
+ * before the thread starts, are written then too. The thread's stack is
+ * sized to hold prefault_stack plus RF24_THREAD_STACK_MARGIN when it would
+ * not already.
+ */
+struct rf24_thread_attr {
+  int32_t  priority;
+  int32_t  cpu;
+  uint8_t  lock_memory;
+  uint32_t prefault_stack;
+};
+
+typedef struct rf24_thread_attr rf24_thread_attr_t;
+
+/* wakeup_latency is IRQ edge to the thread running, service_latency edge to the IRQ being serviced */
+struct rf24_thread_stats {
+  uint32_t wakeups;
+  rf24_histogram_t wakeup_latency, service_latency;
+};
+
+typedef struct rf24_thread_stats rf24_thread_stats_t;
+
+/* A thread doing what rf24_irq_poll() does for one radio, set up for low IRQ latency */
+struct rf24_thread {
+  rf24_t * radio;
+  void (* callback)(void * radio);
+  rf24_thread_attr_t attr;
+  pthread_t thread;
+  uint8_t running;
+  rf24_thread_stats_t stats;
+};
+
+typedef struct rf24_thread rf24_thread_t;
+
+void   rf24_thread_attr_init(rf24_thread_attr_t * attr);
+
+int8_t rf24_thread_start(rf24_thread_t * thread, rf24_t * radio, void (* callback)(void * radio), const rf24_thread_attr_t * attr);
+void   rf24_thread_stop(rf24_thread_t * thread);
+
+void   rf24_thread_get_stats(rf24_thread_t * thread, rf24_thread_stats_t * stats);
+
+#endif
+// vim:ai:cin:et:sts=2 sw=2 ft=c
@@ -2,12 +2,45 @@
 #define __SPI_H__
 
 #include <inttypes.h>
+#include <linux/spi/spidev.h>
 
-int32_t spi_open(char * dev);
-int32_t spi_close(uint32_t fd);
+/* most transfers a single SPI_IOC_MESSAGE may carry */
+#define SPI_MSG_MAX_XFERS 16
 
-int8_t spi_config(uint32_t fd, uint8_t bits, uint32_t speed, uint8_t mode);
-int8_t spi_transfer(uint32_t fd, uint8_t payload);
+/* Open spidev handle. Speed and word size are cached here so a transfer
+ * costs a single SPI_IOC_MESSAGE ioctl.
+ */
+struct spi {
+  int32_t  fd;
+  uint32_t speed;
+  uint8_t  bits, mode;
+};
+
+typedef struct spi spi_t;
+
+/* Queue of transfers submitted as one SPI_IOC_MESSAGE(n). Each spi_msg_add()
+ * starts a new chip select frame (cs_change is set on the transfer before it),
+ * spi_msg_append() continues the current one.
+ */
+struct spi_msg {
+  struct spi_ioc_transfer xfer[SPI_MSG_MAX_XFERS];
+  uint8_t count;
+};
+
+typedef struct spi_msg spi_msg_t;
+
+int32_t spi_open(spi_t * spi, char * dev);
+int32_t spi_close(spi_t * spi);
+
+int8_t spi_config(spi_t * spi, uint8_t bits, uint32_t speed, uint8_t mode);
+int8_t spi_transfer(spi_t * spi, uint8_t payload);
+int8_t spi_transfer_buf(spi_t * spi, const uint8_t * tx, uint8_t * rx, uint32_t len);
+
+void   spi_msg_init(spi_msg_t * msg);
+int8_t spi_msg_add(spi_msg_t * msg, const uint8_t * tx, uint8_t * rx, uint32_t len);
+int8_t spi_msg_append(spi_msg_t * msg, const uint8_t * tx, uint8_t * rx, uint32_t len);
+int8_t spi_msg_submit(spi_t * spi, spi_msg_t * msg);
+int8_t spi_msg_submit_range(spi_t * spi, spi_msg_t * msg, uint8_t first, uint8_t count);
 
 #endif
 // vim:ai:cin:et:sts=2 sw=2 ft=c
@@ -1,4 +1,6 @@
 #include <stdio.h>
+#include <errno.h>
+#include <time.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <sys/epoll.h>
@@ -6,6 +8,9 @@
 #include <assert.h>
 #include "gpio.h"
 
+/* character device used for newly opened lines, NULL selects sysfs */
+static const char * gpio_chip = NULL;
+
 uint8_t gpio_export(uint8_t gpio_pin)
 {
   FILE * file;
@@ -170,59 +175,201 @@ uint8_t gpio_read(uint8_t gpio_pin)
   return ret > 0 ? GPIO_PIN_HIGH : GPIO_PIN_LOW;
 }
 
-uint8_t gpio_poll(uint8_t gpio_pin, uint8_t gpio_edge, void(* callback)(void * arg), void * arg)
+uint8_t gpio_use_chip(const char * chip)
+{
+  if (chip != NULL && access(chip, R_OK | W_OK) != 0) {
+    fprintf(stderr, "[gpio] Can not access %s.\n", chip);
+    return -1;
+  }
+
+  gpio_chip = chip;
+  fprintf(stderr, "[gpio] using %s\n", chip != NULL ? chip : "sysfs");
+
+  return 0;
+}
+
+uint8_t gpio_line_open(gpio_line_t * line, uint8_t gpio_pin, uint8_t gpio_direction)
 {
   char gpio_file[32];
-  struct epoll_event events, ev;
 
-  int32_t fd;
-  uint32_t count;
-  uint8_t i, ret, val;
-  int epfd;
+  line->fd      = -1;
+  line->pin     = gpio_pin;
+  line->backend = GPIO_BACKEND_SYSFS;
+  line->seqno   = 0;
+  line->missed  = 0;
+  line->base    = NULL;
+
+  /* the register block has no edge detection to offer, inputs use one of the other backends */
+  if (gpio_direction == GPIO_PIN_OUTPUT && (line->base = gpio_mmio_acquire()) != NULL) {
+    line->backend = GPIO_BACKEND_MMIO;
+    gpio_mmio_set_function(line->base, gpio_pin, GPIO_FSEL_OUTPUT);
+    return 0;
+  }
 
-  if (gpio_export_wait(gpio_pin) == -1) { return -1; }
-  if (gpio_set_direction(gpio_pin, GPIO_PIN_INPUT) == -1) { return -1; }
-  if (gpio_set_edge(gpio_pin, gpio_edge)) { return -1; }
-  if (callback == NULL) { return -1; }
+  if (gpio_chip != NULL) {
+    return gpio_cdev_line_open(line, gpio_chip, gpio_pin, gpio_direction, GPIO_EDGE_NONE);
+  }
+
+  if (gpio_export_wait(gpio_pin) == (uint8_t) -1) { return -1; }
+  if (gpio_set_direction(gpio_pin, gpio_direction) == (uint8_t) -1) { return -1; }
 
   snprintf(gpio_file, sizeof(gpio_file), "/sys/class/gpio/gpio%d/value", gpio_pin);
-  if ((fd = open(gpio_file, O_RDWR)) == -1) {
-    fprintf(stderr, "[gpio] Error opening /sys/class/gpio/gpio%d/value for reading.\n", gpio_pin);
+  if ((line->fd = open(gpio_file, O_RDWR)) == -1) {
+    fprintf(stderr, "[gpio] Error opening /sys/class/gpio/gpio%d/value.\n", gpio_pin);
+    return -1;
+  }
+
+  return 0;
+}
+
+uint8_t gpio_line_open_edge(gpio_line_t * line, uint8_t gpio_pin, uint8_t gpio_edge)
+{
+  if (gpio_chip != NULL) {
+    return gpio_cdev_line_open(line, gpio_chip, gpio_pin, GPIO_PIN_INPUT, gpio_edge);
+  }
+
+  if (gpio_line_open(line, gpio_pin, GPIO_PIN_INPUT) == (uint8_t) -1) { return -1; }
+  if (gpio_set_edge(gpio_pin, gpio_edge) == (uint8_t) -1) {
+    gpio_line_close(line);
+    return -1;
+  }
+
+  return 0;
+}
+
+uint8_t gpio_line_close(gpio_line_t * line)
+{
+  if (line->backend == GPIO_BACKEND_MMIO && line->base != NULL) {
+    gpio_mmio_release();
+    line->base = NULL;
+  }
+  if (line->fd == -1) { return 0; }
+
+  if (close(line->fd) == -1) {
+    fprintf(stderr, "[gpio] Error closing line %d.\n", line->pin);
+    return -1;
+  }
+  line->fd = -1;
+
+  return 0;
+}
+
+uint8_t gpio_line_write(gpio_line_t * line, uint8_t gpio_value)
+{
+  assert(gpio_value == GPIO_PIN_LOW || gpio_value == GPIO_PIN_HIGH);
+
+  if (line->backend == GPIO_BACKEND_MMIO) {
+    gpio_mmio_write(line->base, line->pin, gpio_value);
+    return 0;
+  }
+
+  if (line->backend == GPIO_BACKEND_CDEV) {
+    return gpio_cdev_line_write(line, gpio_value);
+  }
+
+  if (pwrite(line->fd, gpio_value > 0 ? "1" : "0", 1, 0) != 1) {
+    fprintf(stderr, "[gpio] Error writing /sys/class/gpio/gpio%d/value.\n", line->pin);
+    return -1;
+  }
+
+  return 0;
+}
+
+uint8_t gpio_line_read(gpio_line_t * line)
+{
+  char val;
+
+  if (line->backend == GPIO_BACKEND_MMIO) {
+    return gpio_mmio_read(line->base, line->pin);
+  }
+
+  if (line->backend == GPIO_BACKEND_CDEV) {
+    return gpio_cdev_line_read(line);
+  }
+
+  if (pread(line->fd, &val, 1, 0) != 1) {
+    fprintf(stderr, "[gpio] Error reading /sys/class/gpio/gpio%d/value.\n", line->pin);
+    return -1;
+  }
+
+  return val == '0' ? GPIO_PIN_LOW : GPIO_PIN_HIGH;
+}
+
+uint8_t gpio_line_read_event(gpio_line_t * line, gpio_event_t * event)
+{
+  struct timespec ts;
+  char val;
+
+  if (line->backend == GPIO_BACKEND_CDEV) {
+    return gpio_cdev_line_read_event(line, event);
+  }
+
+  /* sysfs has no event queue, reading the value acknowledges the edge */
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  if (pread(line->fd, &val, 1, 0) != 1) {
     return -1;
   }
 
-  ev.events = EPOLLIN | EPOLLET | EPOLLPRI;
-  ev.data.fd = fd;
+  event->timestamp_ns = (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+  event->seqno        = ++line->seqno;
+
+  return 0;
+}
+
+uint8_t gpio_poll(uint8_t gpio_pin, uint8_t gpio_edge, void(* callback)(void * arg), void * arg)
+{
+  struct epoll_event events, ev;
+  gpio_line_t line;
+  gpio_event_t event;
+  uint32_t missed;
+  int epfd, ret;
+
+  if (callback == NULL) { return -1; }
+  if (gpio_line_open_edge(&line, gpio_pin, gpio_edge) == (uint8_t) -1) { return -1; }
+
+  /* sysfs flags an edge with POLLPRI on the value file, a line request
+   * queues events and stays readable until all of them are consumed
+   */
+  ev.events = line.backend == GPIO_BACKEND_SYSFS ? EPOLLIN | EPOLLET | EPOLLPRI : EPOLLIN;
+  ev.data.fd = line.fd;
 
   if((epfd = epoll_create(1)) == -1) {
       perror("[gpio] epoll_create");
+      gpio_line_close(&line);
       return -1;
   }
 
-  if(epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+  if(epoll_ctl(epfd, EPOLL_CTL_ADD, line.fd, &ev) == -1) {
       perror("[gpio] epoll_ctl");
+      close(epfd);
+      gpio_line_close(&line);
       return -1;
   }
 
-  ret = 0;
+  missed = 0;
 
   while(1) {
     ret = epoll_wait(epfd, &events, 1, -1);
 
     if (ret == -1) {
-      fprintf(stderr, "[gpio] Error polling /sys/class/gpio/gpio%d/value.\n", gpio_pin);
+      if (errno == EINTR) { continue; }
+      fprintf(stderr, "[gpio] Error polling pin %d.\n", gpio_pin);
       break;
     } else
     if (ret == 0) {
       continue;
     } else {
-      read(fd, &val, 1);
+      gpio_line_read_event(&line, &event);
+      if (line.missed != missed) {
+        fprintf(stderr, "[gpio] pin %d missed %d edges\n", gpio_pin, line.missed - missed);
+        missed = line.missed;
+      }
       callback(arg);
     }
   }
-  epoll_ctl(epfd, EPOLL_CTL_DEL, fd, &ev);
+  epoll_ctl(epfd, EPOLL_CTL_DEL, line.fd, &ev);
   close(epfd);
-  close(fd);
+  gpio_line_close(&line);
 
   return ret;
 }
@@ -0,0 +1,112 @@
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <linux/gpio.h>
+#include <assert.h>
+#include "gpio.h"
+
+/* GPIO character device backend (v2 uAPI). Every line gets its own line
+ * request, so pin writes are one ioctl on the request fd and edges are read
+ * from it as gpio_v2_line_event records.
+ */
+
+uint8_t gpio_cdev_line_open(gpio_line_t * line, const char * chip, uint8_t gpio_pin, uint8_t gpio_direction, uint8_t gpio_edge)
+{
+  struct gpio_v2_line_request req;
+  int chip_fd;
+
+  assert (gpio_direction == GPIO_PIN_INPUT || gpio_direction == GPIO_PIN_OUTPUT);
+  assert (gpio_edge == GPIO_EDGE_NONE || gpio_direction == GPIO_PIN_INPUT);
+
+  line->fd      = -1;
+  line->pin     = gpio_pin;
+  line->backend = GPIO_BACKEND_CDEV;
+  line->seqno   = 0;
+  line->missed  = 0;
+  line->base    = NULL;
+
+  if ((chip_fd = open(chip, O_RDWR | O_CLOEXEC)) == -1) {
+    fprintf(stderr, "[gpio] Error opening %s.\n", chip);
+    return -1;
+  }
+
+  memset(&req, 0, sizeof(req));
+  req.offsets[0] = gpio_pin;
+  req.num_lines  = 1;
+  strncpy(req.consumer, "libnrf24", sizeof(req.consumer) - 1);
+
+  if (gpio_direction == GPIO_PIN_OUTPUT) {
+    req.config.flags = GPIO_V2_LINE_FLAG_OUTPUT;
+  } else {
+    req.config.flags = GPIO_V2_LINE_FLAG_INPUT;
+    if (gpio_edge & GPIO_EDGE_RISING)  { req.config.flags |= GPIO_V2_LINE_FLAG_EDGE_RISING; }
+    if (gpio_edge & GPIO_EDGE_FALLING) { req.config.flags |= GPIO_V2_LINE_FLAG_EDGE_FALLING; }
+  }
+
+  if (ioctl(chip_fd, GPIO_V2_GET_LINE_IOCTL, &req) == -1) {
+    fprintf(stderr, "[gpio] Error requesting line %d on %s.\n", gpio_pin, chip);
+    close(chip_fd);
+    return -1;
+  }
+  close(chip_fd);
+
+  line->fd = req.fd;
+  fprintf(stderr, "[gpio] pin %d requested from %s as %s\n", gpio_pin, chip, gpio_direction == GPIO_PIN_INPUT ? "input" : "output");
+
+  return 0;
+}
+
+uint8_t gpio_cdev_line_write(gpio_line_t * line, uint8_t gpio_value)
+{
+  struct gpio_v2_line_values values = {
+    .bits = gpio_value > 0 ? 1 : 0,
+    .mask = 1,
+  };
+
+  assert(gpio_value == GPIO_PIN_LOW || gpio_value == GPIO_PIN_HIGH);
+
+  if (ioctl(line->fd, GPIO_V2_LINE_SET_VALUES_IOCTL, &values) == -1) {
+    fprintf(stderr, "[gpio] Error setting line %d.\n", line->pin);
+    return -1;
+  }
+
+  return 0;
+}
+
+uint8_t gpio_cdev_line_read(gpio_line_t * line)
+{
+  struct gpio_v2_line_values values = {
+    .bits = 0,
+    .mask = 1,
+  };
+
+  if (ioctl(line->fd, GPIO_V2_LINE_GET_VALUES_IOCTL, &values) == -1) {
+    fprintf(stderr, "[gpio] Error reading line %d.\n", line->pin);
+    return -1;
+  }
+
+  return (values.bits & 1) ? GPIO_PIN_HIGH : GPIO_PIN_LOW;
+}
+
+uint8_t gpio_cdev_line_read_event(gpio_line_t * line, gpio_event_t * event)
+{
+  struct gpio_v2_line_event ev;
+
+  if (read(line->fd, &ev, sizeof(ev)) != sizeof(ev)) {
+    return -1;
+  }
+
+  /* line_seqno is per line and gapless, a jump means the kernel dropped edges */
+  if (line->seqno != 0 && ev.line_seqno > line->seqno + 1) {
+    line->missed += ev.line_seqno - line->seqno - 1;
+  }
+  line->seqno = ev.line_seqno;
+
+  event->timestamp_ns = ev.timestamp_ns;
+  event->seqno        = ev.line_seqno;
+
+  return 0;
+}
+// vim:ai:cin:et:sts=2 sw=2 ft=c
@@ -0,0 +1,154 @@
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <assert.h>
+#include "gpio.h"
+
+/* Memory mapped BCM283x GPIO register backend. /dev/gpiomem exposes the GPIO
+ * register block to unprivileged users; the register helpers only take the
+ * mapping base, so any 4k mapping laid out the same way will do.
+ */
+
+#define GPIO_MMIO_BLOCK_SIZE 4096
+
+/* register offsets in 32 bit words */
+#define GPIO_MMIO_GPFSEL0 0
+#define GPIO_MMIO_GPSET0  7
+#define GPIO_MMIO_GPCLR0  10
+#define GPIO_MMIO_GPLEV0  13
+
+/* spin loop iterations per microsecond, 0 until calibrated */
+static uint32_t gpio_loops_per_us = 0;
+static volatile uint32_t * gpio_mmio = NULL;
+/* lines writing through the mapping, it stays in place until they are closed */
+static uint32_t gpio_mmio_users = 0;
+
+static uint64_t gpio_now_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void gpio_spin(uint32_t loops)
+{
+  volatile uint32_t i;
+  for (i = 0; i < loops; i++);
+}
+
+static void gpio_calibrate(void)
+{
+  uint64_t start, elapsed;
+  uint32_t loops = 100000;
+
+  /* grow the sample until it takes at least a millisecond */
+  do {
+    start = gpio_now_ns();
+    gpio_spin(loops);
+    elapsed = gpio_now_ns() - start;
+    if (elapsed < 1000000) { loops *= 2; }
+  } while (elapsed < 1000000);
+
+  gpio_loops_per_us = (uint32_t) ((uint64_t) loops * 1000 / elapsed) + 1;
+  fprintf(stderr, "[gpio] spin delay calibrated to %d loops/us\n", gpio_loops_per_us);
+}
+
+/* Maps the register block of dev for the output lines opened from then on,
+ * NULL drops the mapping. Either fails while lines still write through the
+ * current one.
+ */
+uint8_t gpio_use_mmio(const char * dev)
+{
+  void * map;
+  int fd;
+
+  if (gpio_mmio != NULL) {
+    if (gpio_mmio_users > 0) {
+      fprintf(stderr, "[gpio] Register mapping still used by %d lines.\n", gpio_mmio_users);
+      return -1;
+    }
+    munmap((void *) gpio_mmio, GPIO_MMIO_BLOCK_SIZE);
+    gpio_mmio = NULL;
+    gpio_loops_per_us = 0;
+  }
+
+  if (dev == NULL) { return 0; }
+
+  if ((fd = open(dev, O_RDWR | O_SYNC | O_CLOEXEC)) == -1) {
+    fprintf(stderr, "[gpio] Error opening %s.\n", dev);
+    return -1;
+  }
+
+  map = mmap(NULL, GPIO_MMIO_BLOCK_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+
+  if (map == MAP_FAILED) {
+    fprintf(stderr, "[gpio] Error mapping %s.\n", dev);
+    return -1;
+  }
+
+  gpio_mmio = (volatile uint32_t *) map;
+  if (gpio_loops_per_us == 0) { gpio_calibrate(); }
+
+  fprintf(stderr, "[gpio] using %s for outputs\n", dev);
+
+  return 0;
+}
+
+volatile uint32_t * gpio_mmio_base(void)
+{
+  return gpio_mmio;
+}
+
+/* The mapping for a line to write through, NULL without one; every line that got it gives it back with gpio_mmio_release() */
+volatile uint32_t * gpio_mmio_acquire(void)
+{
+  if (gpio_mmio != NULL) { gpio_mmio_users++; }
+  return gpio_mmio;
+}
+
+void gpio_mmio_release(void)
+{
+  if (gpio_mmio_users > 0) { gpio_mmio_users--; }
+}
+
+void gpio_delay_us(uint32_t us)
+{
+  /* without the register mapping there is nothing to gain from spinning */
+  if (gpio_loops_per_us == 0) {
+    usleep(us);
+    return;
+  }
+
+  gpio_spin(us * gpio_loops_per_us);
+}
+
+void gpio_mmio_set_function(volatile uint32_t * base, uint8_t gpio_pin, uint8_t function)
+{
+  volatile uint32_t * fsel = base + GPIO_MMIO_GPFSEL0 + gpio_pin / 10;
+  uint8_t shift = (gpio_pin % 10) * 3;
+
+  assert(function <= 7);
+
+  *fsel = (*fsel & ~(7 << shift)) | (function << shift);
+}
+
+void gpio_mmio_write(volatile uint32_t * base, uint8_t gpio_pin, uint8_t gpio_value)
+{
+  assert(gpio_value == GPIO_PIN_LOW || gpio_value == GPIO_PIN_HIGH);
+
+  /* set and clear registers only act on the bits written as 1, no read-modify-write needed */
+  if (gpio_value == GPIO_PIN_HIGH) {
+    base[GPIO_MMIO_GPSET0 + gpio_pin / 32] = 1U << (gpio_pin % 32);
+  } else {
+    base[GPIO_MMIO_GPCLR0 + gpio_pin / 32] = 1U << (gpio_pin % 32);
+  }
+}
+
+uint8_t gpio_mmio_read(volatile uint32_t * base, uint8_t gpio_pin)
+{
+  return (base[GPIO_MMIO_GPLEV0 + gpio_pin / 32] >> (gpio_pin % 32)) & 1 ? GPIO_PIN_HIGH : GPIO_PIN_LOW;
+}
+// vim:ai:cin:et:sts=2 sw=2 ft=c
@@ -13,8 +13,12 @@ version 2 as published by the Free Software Foundation.
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
 
 #include "rf24.h"
+#include "rf24_ring.h"
 #include "gpio.h"
 #include "spi.h"
 #include "nRF24L01.h"
@@ -22,203 +26,1389 @@ version 2 as published by the Free Software Foundation.
 #define _BV(x) (1 << (x))
 #define _BN(x, n) ( ( (unsigned char *)(&(x)) )[(n)] )
 
+/* Room for the commands of one transaction: a full payload plus a handful of register accesses. */
+#define RF24_TXN_BUF_SIZE 192
+
+/* Several nRF24 commands queued up and submitted as one SPI message, each
+ * command gets its own chip select frame. Every command occupies
+ * [cmd][data...] in buf; the same bytes are used as rx buffer, so after
+ * submission byte 0 holds STATUS and the rest holds the data clocked back.
+ */
+struct rf24_txn {
+  spi_msg_t msg;
+  uint8_t   buf[RF24_TXN_BUF_SIZE];
+  uint16_t  used;
+};
+
+typedef struct rf24_txn rf24_txn_t;
+
+/* Where a round of RX FIFO reads left the FIFO, see rf24_rx_round() */
+#define RF24_RX_MORE    0
+#define RF24_RX_EMPTY   1
+#define RF24_RX_FLUSHED 2
+
+/* pipe and length of a payload found by rf24_rx_round() */
+struct rf24_rx_found {
+  uint8_t pipe, len;
+};
+
 static const uint8_t pipe_address_registers[]      = { RX_ADDR_P0, RX_ADDR_P1, RX_ADDR_P2, RX_ADDR_P3, RX_ADDR_P4, RX_ADDR_P5 };
 static const uint8_t pipe_payload_size_registers[] = { RX_PW_P0, RX_PW_P1, RX_PW_P2, RX_PW_P3, RX_PW_P4, RX_PW_P5 };
 static const uint8_t pipe_enable_registers[]       = { ERX_P0, ERX_P1, ERX_P2, ERX_P3, ERX_P4, ERX_P5 };
 
-static uint64_t now(void);
-static uint8_t rf24_write_payload(rf24_t * this, uint8_t reg, void * buf, uint8_t len);
-static uint8_t rf24_read_register(rf24_t * this, uint8_t reg);
-static uint8_t rf24_write_register(rf24_t * this, uint8_t reg, uint8_t value);
-static uint64_t rf24_read_address(rf24_t * this, uint8_t pipe_reg);
-static uint8_t rf24_write_address(rf24_t * this, uint8_t pipe_reg, uint64_t address);
-static void rf24_unmask_irqs(rf24_t * this);
-static uint8_t rf24_get_status(rf24_t * this);
-static uint8_t rf24_flush_rx(rf24_t * this);
-static uint8_t rf24_flush_tx(rf24_t * this);
-static uint8_t rf24_get_data_rate(rf24_t * this);
-static void rf24_enable_features(rf24_t * this);
+/* configuration registers mirrored in this->regs, see rf24_cached_register() */
+static const uint8_t shadowed_registers[] = {
+  CONFIG, EN_AA, EN_RXADDR, SETUP_AW, SETUP_RETR, RF_CH, RF_SETUP,
+  RX_PW_P0, RX_PW_P1, RX_PW_P2, RX_PW_P3, RX_PW_P4, RX_PW_P5, DYNPD, FEATURE
+};
+
+static int8_t rf24_spidev_transfer(void * ctx, spi_msg_t * msg, uint8_t first, uint8_t count);
+static void rf24_spidev_csn(void * ctx, uint8_t level);
+static void rf24_spidev_ce(void * ctx, uint8_t level);
+static int8_t rf24_spidev_irq_wait(void * ctx, int32_t timeout_ms, uint64_t * timestamp_ns);
+static int32_t rf24_spidev_irq_fd(void * ctx, uint32_t * events);
+static void rf24_sleep_until(uint64_t ns);
+static uint32_t rf24_frame_us(rf24_t * this, uint8_t len);
+static uint32_t rf24_retry_period_us(rf24_t * this, uint8_t len);
+static void rf24_check_retry_delay(rf24_t * this);
+static void rf24_ce(rf24_t * this, uint8_t level);
+static void rf24_tx_pulse(rf24_t * this);
+static void rf24_fill_rx_ring(rf24_t * this);
+static void rf24_defaults(rf24_t * this);
+static uint8_t rf24_setup(rf24_t * this);
+static uint8_t rf24_command(rf24_t * this, uint8_t cmd, const void * tx, void * rx, uint8_t len);
+static void rf24_txn_init(rf24_txn_t * txn);
+static uint8_t * rf24_txn_add(rf24_txn_t * txn, uint8_t cmd, const void * tx, uint8_t len);
+static uint8_t * rf24_txn_add_buf(rf24_txn_t * txn, uint8_t * buf, uint8_t cmd, uint8_t len);
+static uint8_t * rf24_txn_read_register(rf24_txn_t * txn, uint8_t reg);
+static uint8_t * rf24_txn_write_register(rf24_t * this, rf24_txn_t * txn, uint8_t reg, uint8_t value);
+static uint8_t * rf24_txn_write_address(rf24_txn_t * txn, uint8_t pipe_reg, uint64_t address);
+static uint8_t * rf24_txn_write_payload(rf24_t * this, rf24_txn_t * txn, uint8_t reg, void * buf, uint8_t len);
+static uint8_t * rf24_txn_write_payloadv(rf24_t * this, rf24_txn_t * txn, uint8_t reg, const struct iovec * iov, uint8_t iovcnt);
+static void rf24_txn_submit(rf24_t * this, rf24_txn_t * txn);
+static uint8_t rf24_write_payload(rf24_t * this, uint8_t reg, void * buf, uint8_t len);
+static uint8_t rf24_read_register(rf24_t * this, uint8_t reg);
+static uint8_t rf24_write_register(rf24_t * this, uint8_t reg, uint8_t value);
+static uint8_t rf24_is_shadowed(uint8_t reg);
+static uint8_t rf24_cached_register(rf24_t * this, uint8_t reg);
+static uint64_t rf24_read_address(rf24_t * this, uint8_t pipe_reg);
+static void rf24_unmask_irqs(rf24_t * this);
+static uint8_t rf24_get_status(rf24_t * this);
+static uint8_t rf24_flush_rx(rf24_t * this);
+static uint8_t rf24_flush_tx(rf24_t * this);
+static uint8_t rf24_get_data_rate(rf24_t * this);
+static void rf24_enable_features(rf24_t * this);
+
+/* spidev with CSN on a GPIO, framed by the radio around each command */
+static const rf24_transport_t rf24_spidev_transport = {
+  .transfer = rf24_spidev_transfer,
+  .csn      = rf24_spidev_csn,
+  .ce       = rf24_spidev_ce,
+  .irq_wait = rf24_spidev_irq_wait,
+  .irq_fd   = rf24_spidev_irq_fd,
+};
+
+/* spidev with the controller's chip select, transactions go out as one message */
+static const rf24_transport_t rf24_spidev_hw_cs_transport = {
+  .transfer = rf24_spidev_transfer,
+  .csn      = NULL,
+  .ce       = rf24_spidev_ce,
+  .irq_wait = rf24_spidev_irq_wait,
+  .irq_fd   = rf24_spidev_irq_fd,
+};
+
+uint64_t rf24_now_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void rf24_histogram_add(rf24_histogram_t * histogram, uint64_t ns)
+{
+  uint64_t us = ns / 1000;
+  uint8_t bucket = us == 0 ? 0 : 64 - __builtin_clzll(us);
+
+  if (bucket >= RF24_HISTOGRAM_BUCKETS) { bucket = RF24_HISTOGRAM_BUCKETS - 1; }
+
+  histogram->buckets[bucket]++;
+  histogram->count++;
+  if (us > histogram->max_us) { histogram->max_us = us > UINT32_MAX ? UINT32_MAX : us; }
+}
+
+static void rf24_sleep_until(uint64_t ns)
+{
+  struct timespec ts;
+
+  ts.tv_sec  = ns / 1000000000ULL;
+  ts.tv_nsec = ns % 1000000000ULL;
+  while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR);
+}
+
+/* On-air time of an Enhanced ShockBurst frame carrying len payload bytes:
+ * preamble, address, 9 bit packet control field, payload and CRC, at the
+ * configured data rate. Everything comes from the register shadow.
+ */
+static uint32_t rf24_frame_us(rf24_t * this, uint8_t len)
+{
+  uint8_t setup  = rf24_cached_register(this, RF_SETUP);
+  uint8_t config = rf24_cached_register(this, CONFIG);
+  uint8_t aw     = (rf24_cached_register(this, SETUP_AW) & 0b11) + 2;
+  uint8_t crc    = (config & _BV(EN_CRC)) ? ((config & _BV(CRCO)) ? 2 : 1) : 0;
+  uint32_t bits  = 8 * (1 + aw + len + crc) + 9;
+  uint32_t kbps  = (setup & _BV(RF_DR_LOW)) ? 250 : ((setup & _BV(RF_DR_HIGH)) ? 2000 : 1000);
+
+  return (bits * 1000 + kbps - 1) / kbps;
+}
+
+/* From the end of one attempt to the end of the next: the ARD wait, settling and the frame */
+static uint32_t rf24_retry_period_us(rf24_t * this, uint8_t len)
+{
+  uint32_t ard = ((rf24_cached_register(this, SETUP_RETR) >> ARD) & 0xF) * 250 + 250;
+
+  return ard + RF24_TSTDBY2A_US + rf24_airtime_us(this, len);
+}
+
+uint32_t rf24_airtime_us(rf24_t * this, uint8_t len)
+{
+  /* static payloads go out padded to the payload size, see rf24_txn_write_payload() */
+  if (!this->dynamic_payloads_enabled && len < this->payload_size) { len = this->payload_size; }
+
+  return rf24_frame_us(this, len);
+}
+
+uint32_t rf24_send_time_us(rf24_t * this, uint8_t len)
+{
+  uint32_t us = RF24_TSTDBY2A_US + rf24_airtime_us(this, len);
+
+  /* the receiver turns around and answers with an ack, taken as an empty one */
+  if (rf24_cached_register(this, EN_AA) & _BV(ENAA_P0)) {
+    us += RF24_TSTDBY2A_US + rf24_frame_us(this, 0);
+  }
+  return us;
+}
+
+uint32_t rf24_max_rt_time_us(rf24_t * this, uint8_t len)
+{
+  uint8_t arc = (rf24_cached_register(this, SETUP_RETR) >> ARC) & 0xF;
+
+  if (!(rf24_cached_register(this, EN_AA) & _BV(ENAA_P0))) {
+    return rf24_send_time_us(this, len);
+  }
+
+  /* the first attempt and ARC retransmits, each followed by a full ARD waiting for its ack */
+  return (arc + 1) * rf24_retry_period_us(this, len);
+}
+
+/* The ack has to be in before ARD runs out: the receiver settles for
+ * Tstdby2a, sends the ack frame, and both radios turn around on top of that.
+ * At 250kbps the datasheet asks for an ARD of at least 500us no matter what.
+ * Returns -1 when not even an empty ack fits.
+ */
+int8_t rf24_max_ack_payload(rf24_t * this)
+{
+  uint32_t ard = ((rf24_cached_register(this, SETUP_RETR) >> ARD) & 0xF) * 250 + 250;
+  uint8_t setup = rf24_cached_register(this, RF_SETUP);
+  uint32_t turnaround = RF24_TSTDBY2A_US;
+  int8_t len;
+
+  if (setup & _BV(RF_DR_LOW)) {
+    if (ard < 500) { return -1; }
+    turnaround += RF24_ACK_TURNAROUND_250KBPS_US;
+  } else if (setup & _BV(RF_DR_HIGH)) {
+    turnaround += RF24_ACK_TURNAROUND_2MBPS_US;
+  }
+
+  for (len = RF24_MAX_PAYLOAD; len >= 0; len--) {
+    if (turnaround + rf24_frame_us(this, len) <= ard) { return len; }
+  }
+  return -1;
+}
+
+static void rf24_check_retry_delay(rf24_t * this)
+{
+  int8_t fits = rf24_max_ack_payload(this);
+
+  if (fits < 0) {
+    fprintf(stderr, "[rf24] Auto retransmit delay too short for acks at this data rate\n");
+  } else if (this->ack_payload_enabled && fits < RF24_MAX_PAYLOAD) {
+    fprintf(stderr, "[rf24] Auto retransmit delay only fits ack payloads up to %d bytes at this data rate\n", fits);
+  }
+}
+
+void rf24_open_reading_pipe(rf24_t * this, uint8_t pipe, uint64_t address)
+{
+  assert(pipe >= 0 && pipe <= 5);
+
+  if (pipe == 0) {
+    this->pipe0_address = address;
+  }
+
+  rf24_txn_t txn;
+
+  rf24_txn_init(&txn);
+
+  /* all pipes have 5 bytes configurable address, pipe 0 has unique 5 byte address, other pipes share first 4 bytes. */
+  if (pipe == 0 || pipe == 1) {
+    rf24_txn_write_address(&txn, pipe_address_registers[pipe], address);
+  } else {
+    rf24_txn_write_register(this, &txn, pipe_address_registers[pipe], (uint8_t) address);
+  }
+  rf24_txn_write_register(this, &txn, pipe_payload_size_registers[pipe], this->payload_size);
+  rf24_txn_write_register(this, &txn, EN_RXADDR, rf24_cached_register(this, EN_RXADDR) | _BV(pipe_enable_registers[pipe]));
+  rf24_txn_submit(this, &txn);
+}
+
+/* Points every pipe in mask at addresses[pipe] and enables it, and disables
+ * the pipes in close_mask, all in one SPI message. Pipes 2-5 only take the low
+ * byte of their address, the rest is pipe 1's.
+ */
+void rf24_set_reading_pipes(rf24_t * this, uint8_t mask, const uint64_t * addresses, uint8_t close_mask)
+{
+  rf24_txn_t txn;
+  uint8_t enabled = rf24_cached_register(this, EN_RXADDR), pipe, writes = 0;
+
+  rf24_txn_init(&txn);
+  for (pipe = 0; pipe < 6; pipe++) {
+    if (!(mask & _BV(pipe))) { continue; }
+
+    if (pipe == 0 || pipe == 1) {
+      rf24_txn_write_address(&txn, pipe_address_registers[pipe], addresses[pipe]);
+      if (pipe == 0) { this->pipe0_address = addresses[pipe]; }
+    } else {
+      rf24_txn_write_register(this, &txn, pipe_address_registers[pipe], (uint8_t) addresses[pipe]);
+    }
+    writes++;
+
+    if (rf24_cached_register(this, pipe_payload_size_registers[pipe]) != this->payload_size) {
+      rf24_txn_write_register(this, &txn, pipe_payload_size_registers[pipe], this->payload_size);
+    }
+    enabled |= _BV(pipe_enable_registers[pipe]);
+  }
+
+  enabled &= ~close_mask;
+  if (enabled != rf24_cached_register(this, EN_RXADDR)) {
+    rf24_txn_write_register(this, &txn, EN_RXADDR, enabled);
+    writes++;
+  }
+
+  if (writes > 0) { rf24_txn_submit(this, &txn); }
+}
+
+void rf24_open_writing_pipe(rf24_t * this, uint64_t address)
+{
+  rf24_txn_t txn;
+
+  rf24_txn_init(&txn);
+  rf24_txn_write_address(&txn, pipe_address_registers[0], address);
+  rf24_txn_write_address(&txn, TX_ADDR, address);
+  rf24_txn_write_register(this, &txn, pipe_payload_size_registers[0], this->payload_size);
+  rf24_txn_submit(this, &txn);
+}
+
+void rf24_start_listening(rf24_t * this)
+{
+  rf24_txn_t txn;
+
+  rf24_txn_init(&txn);
+  rf24_txn_write_register(this, &txn, CONFIG, rf24_cached_register(this, CONFIG) | _BV(PWR_UP) | _BV(PRIM_RX));
+  rf24_txn_write_register(this, &txn, STATUS, _BV(RX_DR) | _BV(TX_DS) | _BV(MAX_RT) );
+
+  if (this->pipe0_address) {
+    rf24_txn_write_address(&txn, RX_ADDR_P0, this->pipe0_address);
+  }
+  rf24_txn_submit(this, &txn);
+
+  rf24_ce(this, GPIO_PIN_HIGH);
+
+  /* RX mode is reached Tstdby2a after CE goes high */
+  usleep(RF24_TSTDBY2A_US);
+}
+
+void rf24_stop_listening(rf24_t * this)
+{
+  rf24_txn_t txn;
+
+  rf24_ce(this, GPIO_PIN_LOW);
+
+  rf24_txn_init(&txn);
+  rf24_txn_add(&txn, FLUSH_RX, NULL, 0);
+  rf24_txn_add(&txn, FLUSH_TX, NULL, 0);
+  rf24_txn_submit(this, &txn);
+}
+
+void rf24_dump(rf24_t * this)
+{
+  uint64_t addr, txaddr;
+  uint8_t status = rf24_get_status(this);
+  uint8_t i, reg;
+
+  fprintf(stderr, "[rf24] Device configuration\n");
+  if (this->csn_pin == RF24_CSN_HW) {
+    fprintf(stderr, "[rf24] CE: %d CS: hardware\n", this->ce_pin);
+  } else {
+    fprintf(stderr, "[rf24] CE: %d CS: %d\n", this->ce_pin, this->csn_pin);
+  }
+  fprintf(stderr, "[rf24] P variant: %s\n", this->p_variant ? "yes" : "no");
+  fprintf(stderr, "[rf24] STATUS register: 0x%02x RX_DR=%x TX_DS=%x MAX_RT=%x RX_P_NO=%x TX_FULL=%x\n",
+      status,
+      (status & _BV(RX_DR))?  1:0,
+      (status & _BV(TX_DS))?  1:0,
+      (status & _BV(MAX_RT))? 1:0,
+      ((status >> RX_P_NO) & 0b111),
+      (status & _BV(TX_FULL))? 1:0
+      );
+
+  for (i = 0; i < 6; i++) {
+    addr = rf24_read_address(this, pipe_address_registers[i]);
+    fprintf(stderr, "[rf24] RX_ADDR_P%d: %x %x %x %x %x\n", i, _BN(addr, 4), _BN(addr, 3), _BN(addr, 2), _BN(addr, 1), _BN(addr, 0));
+  }
+
+  for (i = 0; i < 6; i++) {
+    reg = rf24_read_register(this, pipe_payload_size_registers[i]);
+    fprintf(stderr, "[rf24] RX_PW_P%d: 0x%02x\n", i, reg);
+  }
+
+  reg = rf24_read_register(this, EN_RXADDR);
+  for (i = 0; i < 6; i++) {
+    fprintf(stderr, "[rf24] ERX_P%d: %d\n", i, (reg & _BV(pipe_enable_registers[i])) >> pipe_enable_registers[i]);
+  }
+
+  txaddr = rf24_read_address(this, TX_ADDR);
+  fprintf(stderr, "[rf24] TX_ADDR: %x %x %x %x %x\n", _BN(txaddr, 4), _BN(txaddr, 3), _BN(txaddr, 2), _BN(txaddr, 1), _BN(txaddr, 0));
+
+  fprintf(stderr, "[rf24] EN_RXADDR: 0x%02x\n", rf24_read_register(this, EN_RXADDR));
+  fprintf(stderr, "[rf24] RF_CH: 0x%02x\n", rf24_read_register(this, RF_CH));
+  fprintf(stderr, "[rf24] EN_AA: 0x%02x\n", rf24_read_register(this, EN_AA));
+  fprintf(stderr, "[rf24] RF_SETUP: 0x%02x\n", rf24_read_register(this, RF_SETUP));
+  fprintf(stderr, "[rf24] CONFIG: 0x%02x\n", rf24_read_register(this, CONFIG));
+  fprintf(stderr, "[rf24] DYNPD, FEATURE: 0x%02x 0x%02x\n", rf24_read_register(this, DYNPD), rf24_read_register(this, FEATURE));
+
+  reg = rf24_get_data_rate(this);
+  fprintf(stderr, "[rf24] Data rate: %s\n", reg == RF24_250KBPS ? "250KBPS" : ((reg == RF24_1MBPS) ? "1MBPS" : "2MBPS"));
+
+  reg = rf24_get_crc_length(this);
+  fprintf(stderr, "[rf24] CRC: %s\n", reg == RF24_CRC_DISABLED ? "Disabled" : ((reg == RF24_CRC_8) ? "8bit" : "16bit"));
+}
+
+static int8_t rf24_spidev_transfer(void * ctx, spi_msg_t * msg, uint8_t first, uint8_t count)
+{
+  rf24_t * this = (rf24_t *) ctx;
+  return spi_msg_submit_range(&this->spi, msg, first, count);
+}
+
+static void rf24_spidev_csn(void * ctx, uint8_t level)
+{
+  rf24_t * this = (rf24_t *) ctx;
+  gpio_line_write(&this->csn_line, level);
+}
+
+static void rf24_spidev_ce(void * ctx, uint8_t level)
+{
+  rf24_t * this = (rf24_t *) ctx;
+  gpio_line_write(&this->ce_line, level);
+}
+
+static int8_t rf24_spidev_irq_wait(void * ctx, int32_t timeout_ms, uint64_t * timestamp_ns)
+{
+  rf24_t * this = (rf24_t *) ctx;
+  struct pollfd pfd;
+  gpio_event_t event;
+  uint32_t missed = this->irq_line.missed;
+  uint8_t asserted, stamped = 0;
+  int ret;
+
+  if (this->irq_line.fd == -1) { return -1; }
+
+  /* IRQ is active low and stays asserted until STATUS is cleared, an edge may be long gone */
+  asserted = gpio_line_read(&this->irq_line) == GPIO_PIN_LOW;
+  if (asserted) { *timestamp_ns = rf24_now_ns(); }
+
+  pfd.fd      = this->irq_line.fd;
+  pfd.events  = this->irq_line.backend == GPIO_BACKEND_SYSFS ? POLLPRI : POLLIN;
+
+  /* queued edges get consumed either way, or the fd handed out by
+   * rf24_get_irq_fd() would keep polling readable; the first of them is the
+   * one that asserted the line
+   */
+  while ((ret = poll(&pfd, 1, asserted ? 0 : timeout_ms)) > 0) {
+    if (gpio_line_read_event(&this->irq_line, &event) == (uint8_t) -1) { break; }
+    if (!stamped) {
+      *timestamp_ns = event.timestamp_ns;
+      stamped = 1;
+    }
+    asserted = 1;
+  }
+  /* edges the kernel dropped, the cdev backend tells from the gaps in their seqno */
+  this->stats.irq_missed += this->irq_line.missed - missed;
+
+  if (ret == -1 && errno != EINTR) { return -1; }
+
+  return asserted;
+}
+
+static int32_t rf24_spidev_irq_fd(void * ctx, uint32_t * events)
+{
+  rf24_t * this = (rf24_t *) ctx;
+
+  *events = this->irq_line.backend == GPIO_BACKEND_SYSFS ? POLLPRI : POLLIN;
+  return this->irq_line.fd;
+}
+
+static void rf24_ce(rf24_t * this, uint8_t level)
+{
+  this->stats.gpio_writes++;
+  this->transport->ce(this->transport_ctx, level);
+}
+
+static void rf24_tx_pulse(rf24_t * this)
+{
+  this->tx_started = rf24_now_ns();
+
+  /* Activate the TX mode for at least 10us (nRF24L01P_Product_spec, page 43 - Fig. 16) */
+  rf24_ce(this, GPIO_PIN_HIGH);
+  gpio_delay_us(10);
+  rf24_ce(this, GPIO_PIN_LOW);
+}
+
+static uint8_t rf24_command(rf24_t * this, uint8_t cmd, const void * tx, void * rx, uint8_t len)
+{
+  rf24_txn_t txn;
+  uint8_t * pos;
+
+  /* command byte and its data go out as one full duplex transfer, the first byte clocked back is STATUS */
+  rf24_txn_init(&txn);
+  pos = rf24_txn_add(&txn, cmd, tx, len);
+  rf24_txn_submit(this, &txn);
+
+  if (rx != NULL) {
+    memcpy(rx, pos + 1, len);
+  }
+  return pos[0];
+}
+
+static void rf24_txn_init(rf24_txn_t * txn)
+{
+  spi_msg_init(&txn->msg);
+  txn->used = 0;
+}
+
+static uint8_t * rf24_txn_add(rf24_txn_t * txn, uint8_t cmd, const void * tx, uint8_t len)
+{
+  uint8_t * pos = txn->buf + txn->used;
+
+  assert(txn->used + len + 1 <= RF24_TXN_BUF_SIZE);
+
+  pos[0] = cmd;
+  if (tx != NULL) {
+    memcpy(pos + 1, tx, len);
+  } else {
+    memset(pos + 1, 0xFF, len);
+  }
+
+  if (spi_msg_add(&txn->msg, pos, pos, len + 1) == -1) {
+    assert(0);
+  }
+  txn->used += len + 1;
+
+  return pos;
+}
+
+/* Like rf24_txn_add(), but the command is clocked out of and back into buf, which has room for it and len bytes */
+static uint8_t * rf24_txn_add_buf(rf24_txn_t * txn, uint8_t * buf, uint8_t cmd, uint8_t len)
+{
+  buf[0] = cmd;
+  memset(buf + 1, 0xFF, len);
+
+  if (spi_msg_add(&txn->msg, buf, buf, len + 1) == -1) {
+    assert(0);
+  }
+
+  return buf;
+}
+
+static uint8_t * rf24_txn_read_register(rf24_txn_t * txn, uint8_t reg)
+{
+  return rf24_txn_add(txn, R_REGISTER | ( REGISTER_MASK & reg ), NULL, 1);
+}
+
+static uint8_t * rf24_txn_write_register(rf24_t * this, rf24_txn_t * txn, uint8_t reg, uint8_t value)
+{
+  if (rf24_is_shadowed(reg)) {
+    this->regs[reg] = value;
+  }
+  return rf24_txn_add(txn, W_REGISTER | ( REGISTER_MASK & reg ), &value, 1);
+}
+
+static uint8_t * rf24_txn_write_address(rf24_txn_t * txn, uint8_t pipe_reg, uint64_t address)
+{
+  return rf24_txn_add(txn, W_REGISTER | ( REGISTER_MASK & pipe_reg ), &address, 5);
+}
+
+static uint8_t * rf24_txn_write_payload(rf24_t * this, rf24_txn_t * txn, uint8_t reg, void * buf, uint8_t len)
+{
+  uint8_t * pos;
+  uint8_t blanks;
+
+  if (!this->dynamic_payloads_enabled) { assert(len <= this->payload_size); }
+  assert(reg == W_TX_PAYLOAD || reg == W_TX_PAYLOAD_NOACK || this->ack_payload_enabled);
+
+  blanks = this->dynamic_payloads_enabled ? 0 : this->payload_size - len;
+  if (reg != W_TX_PAYLOAD && reg != W_TX_PAYLOAD_NOACK) { blanks = 0; }
+
+  pos = rf24_txn_add(txn, reg, NULL, len + blanks);
+  memcpy(pos + 1, buf, len);
+  memset(pos + 1 + len, 0x0, blanks);
+
+  return pos;
+}
+
+/* Streams a payload gathered from iovcnt segments: the command byte comes
+ * from the transaction buffer, the segments are clocked out from where they
+ * are and static payloads are padded from a zero block, all in the command's
+ * chip select frame. Nothing is clocked back into the segments.
+ */
+static uint8_t * rf24_txn_write_payloadv(rf24_t * this, rf24_txn_t * txn, uint8_t reg, const struct iovec * iov, uint8_t iovcnt)
+{
+  static const uint8_t zeros[RF24_MAX_PAYLOAD];
+  uint8_t * pos;
+  uint32_t len = 0;
+  uint8_t blanks, i;
+
+  /* a lone segment is cheaper copied into the command's transfer than given one of its own */
+  if (iovcnt == 1) {
+    return rf24_txn_write_payload(this, txn, reg, iov[0].iov_base, iov[0].iov_len);
+  }
+
+  assert(iovcnt <= RF24_MAX_SEGMENTS);
+  for (i = 0; i < iovcnt; i++) { len += iov[i].iov_len; }
+
+  assert(len <= RF24_MAX_PAYLOAD);
+  if (!this->dynamic_payloads_enabled) { assert(len <= this->payload_size); }
+  assert(reg == W_TX_PAYLOAD || reg == W_TX_PAYLOAD_NOACK || this->ack_payload_enabled);
+
+  blanks = this->dynamic_payloads_enabled ? 0 : this->payload_size - len;
+  if (reg != W_TX_PAYLOAD && reg != W_TX_PAYLOAD_NOACK) { blanks = 0; }
+
+  pos = rf24_txn_add(txn, reg, NULL, 0);
+  for (i = 0; i < iovcnt; i++) {
+    if (iov[i].iov_len == 0) { continue; }
+    if (spi_msg_append(&txn->msg, iov[i].iov_base, NULL, iov[i].iov_len) == -1) {
+      assert(0);
+    }
+  }
+  if (blanks > 0 && spi_msg_append(&txn->msg, zeros, NULL, blanks) == -1) {
+    assert(0);
+  }
+
+  return pos;
+}
+
+static void rf24_txn_submit(rf24_t * this, rf24_txn_t * txn)
+{
+  const rf24_transport_t * transport = this->transport;
+  uint8_t i, end;
+
+  this->stats.spi_transactions++;
+
+  if (transport->csn == NULL) {
+    this->stats.spi_messages++;
+    transport->transfer(this->transport_ctx, &txn->msg, 0, txn->msg.count);
+    return;
+  }
+
+  /* CSN is driven from a GPIO, which the SPI controller can not toggle
+   * between the commands, so every command is clocked out on its own.
+   */
+  for (i = 0; i < txn->msg.count; i = end + 1) {
+    for (end = i; end + 1 < txn->msg.count && !txn->msg.xfer[end].cs_change; end++);
+
+    this->stats.spi_messages++;
+    this->stats.gpio_writes += 2;
+
+    transport->csn(this->transport_ctx, GPIO_PIN_LOW);
+    transport->transfer(this->transport_ctx, &txn->msg, i, end - i + 1);
+    transport->csn(this->transport_ctx, GPIO_PIN_HIGH);
+  }
+}
+
+static uint8_t rf24_write_payload(rf24_t * this, uint8_t reg, void * buf, uint8_t len)
+{
+  rf24_txn_t txn;
+  uint8_t * status;
+
+  /* send the data out */
+  rf24_txn_init(&txn);
+  status = rf24_txn_write_payload(this, &txn, reg, buf, len);
+  rf24_txn_submit(this, &txn);
+
+  return status[0];
+}
+
+void rf24_send_ack_on_pipe(rf24_t * this, uint8_t pipe_no, void * buf, uint8_t len)
+{
+  rf24_write_payload(this, (W_ACK_PAYLOAD | (pipe_no & 0b111)), buf, len);
+}
+
+/* Drops the ack payloads queued for every pipe and queues buf for pipe_no, in
+ * one SPI message. The flush is accounted for like rf24_flush_tx(), buf then
+ * holds pipe_no's slot in the chip.
+ */
+void rf24_replace_ack_payload(rf24_t * this, uint8_t pipe_no, void * buf, uint8_t len)
+{
+  struct rf24_ack_queue * queue;
+  rf24_txn_t txn;
+  uint8_t pipe;
+
+  for (pipe = 0; pipe < 6; pipe++) { this->ack_queues[pipe].in_chip = 0; }
+  if (pipe_no < 6 && len <= RF24_MAX_PAYLOAD) {
+    queue = &this->ack_queues[pipe_no];
+    queue->in_chip = 1;
+    memset(&queue->loaded, 0, sizeof(struct rf24_ack_entry));
+    memcpy(queue->loaded.data, buf, len);
+    queue->loaded.len = len;
+    queue->loaded.seq = this->ack_seq++;
+  }
+
+  rf24_txn_init(&txn);
+  rf24_txn_add(&txn, FLUSH_TX, NULL, 0);
+  rf24_txn_write_payload(this, &txn, (W_ACK_PAYLOAD | (pipe_no & 0b111)), buf, len);
+  rf24_txn_submit(this, &txn);
+}
+
+void rf24_send_ackv(rf24_t * this, uint8_t pipe_no, const struct iovec * iov, uint8_t iovcnt)
+{
+  rf24_txn_t txn;
+
+  rf24_txn_init(&txn);
+  rf24_txn_write_payloadv(this, &txn, (W_ACK_PAYLOAD | (pipe_no & 0b111)), iov, iovcnt);
+  rf24_txn_submit(this, &txn);
+}
+
+/* Queued ack payloads.
+ *
+ * The chip keeps ack payloads in its TX FIFO, three for all pipes together,
+ * and sends the oldest one of a pipe along with the ack of the next frame on
+ * it. The library keeps at most one payload per pipe in there, so what goes
+ * next is only decided once the last one went out: every payload read from a
+ * pipe frees its slot, and the best entry of the pipe's queue takes it, the
+ * highest priority first and the oldest among equals, expired ones dropped.
+ * Pipes waiting for a slot take turns. Whenever the TX FIFO is seen empty the
+ * count of what it holds starts over, acks lost on the air throw it off.
+ */
+static uint8_t rf24_ack_before(const struct rf24_ack_entry * a, const struct rf24_ack_entry * b)
+{
+  if (a->priority != b->priority) { return a->priority > b->priority; }
+  return (int32_t) (a->seq - b->seq) < 0;
+}
+
+/* Index of the entry to send next, -1 when there is none left after dropping the expired ones */
+static int8_t rf24_ack_best(rf24_t * this, struct rf24_ack_queue * queue, uint64_t now)
+{
+  struct rf24_ack_entry * entry;
+  int8_t best = -1;
+  uint8_t i = 0;
+
+  while (i < queue->count) {
+    entry = &queue->entries[i];
+    if (entry->expires_ns && entry->expires_ns <= now) {
+      *entry = queue->entries[--queue->count];
+      this->stats.ack_expired++;
+      continue;
+    }
+    if (best == -1 || rf24_ack_before(entry, &queue->entries[best])) { best = i; }
+    i++;
+  }
+
+  return best;
+}
+
+/* A payload arrived on pipe, its ack took the pipe's payload along if it had one */
+static void rf24_ack_sent(rf24_t * this, uint8_t pipe)
+{
+  if (pipe < 6 && this->ack_queues[pipe].in_chip > 0) { this->ack_queues[pipe].in_chip--; }
+}
+
+/* Adds the payloads for the free ack slots to txn, returns how many */
+static uint8_t rf24_ack_load(rf24_t * this, rf24_txn_t * txn)
+{
+  struct rf24_ack_queue * queue;
+  struct rf24_ack_entry * entry;
+  uint64_t now = 0;
+  uint8_t in_chip = 0, loaded = 0, pipe, i;
+  int8_t best;
+
+  for (pipe = 0; pipe < 6; pipe++) {
+    in_chip += this->ack_queues[pipe].in_chip;
+  }
+
+  for (i = 0; i < 6 && in_chip < RF24_TX_FIFO_DEPTH; i++) {
+    pipe  = (this->ack_next + i) % 6;
+    queue = &this->ack_queues[pipe];
+    if (queue->count == 0 || queue->in_chip > 0) { continue; }
+
+    if (now == 0) { now = rf24_now_ns(); }
+    if ((best = rf24_ack_best(this, queue, now)) == -1) { continue; }
+
+    /* the payload is copied into the transaction, the entry can go */
+    entry = &queue->entries[best];
+    rf24_txn_write_payload(this, txn, W_ACK_PAYLOAD | pipe, entry->data, entry->len);
+    queue->loaded = *entry;
+    *entry = queue->entries[--queue->count];
+
+    queue->in_chip++;
+    in_chip++;
+    loaded++;
+    this->ack_next = (pipe + 1) % 6;
+  }
+
+  return loaded;
+}
+
+/* Puts an entry into pipe_no's queue, -1 when it is full of higher priority ones */
+static int8_t rf24_ack_enqueue(rf24_t * this, uint8_t pipe_no, const void * buf, uint8_t len, uint8_t priority, uint64_t expires_ns)
+{
+  struct rf24_ack_queue * queue = &this->ack_queues[pipe_no];
+  struct rf24_ack_entry * entry;
+  uint8_t last, i;
+
+  if (queue->count == RF24_ACK_QUEUE_DEPTH) {
+    for (last = 0, i = 1; i < queue->count; i++) {
+      if (rf24_ack_before(&queue->entries[last], &queue->entries[i])) { last = i; }
+    }
+
+    this->stats.ack_dropped++;
+    if (queue->entries[last].priority >= priority) { return -1; }
+    entry = &queue->entries[last];
+  } else {
+    entry = &queue->entries[queue->count++];
+  }
+
+  memcpy(entry->data, buf, len);
+  entry->len        = len;
+  entry->priority   = priority;
+  entry->seq        = this->ack_seq++;
+  entry->expires_ns = expires_ns;
+  this->stats.ack_queued++;
+
+  return 0;
+}
+
+/* Moves what other threads posted into the queues, returns how many */
+static uint8_t rf24_ack_take_posts(rf24_t * this)
+{
+  uint32_t tail = this->ack_post_tail;
+  uint32_t head = __atomic_load_n(&this->ack_post_head, __ATOMIC_ACQUIRE);
+  struct rf24_ack_post * post;
+  uint8_t taken = 0;
+
+  for (; tail != head; tail++, taken++) {
+    post = &this->ack_posts[tail & (RF24_ACK_POST_DEPTH - 1)];
+    rf24_ack_enqueue(this, post->pipe, post->data, post->len, post->priority, post->expires_ns);
+  }
+  __atomic_store_n(&this->ack_post_tail, tail, __ATOMIC_RELEASE);
+
+  return taken;
+}
+
+/* Fills the free ack slots from the queues, all in one SPI message */
+static void rf24_ack_refill(rf24_t * this, uint8_t tx_empty)
+{
+  rf24_txn_t txn;
+  uint8_t loaded, pipe;
+
+  if (tx_empty) {
+    for (pipe = 0; pipe < 6; pipe++) { this->ack_queues[pipe].in_chip = 0; }
+  }
+  rf24_ack_take_posts(this);
+
+  rf24_txn_init(&txn);
+  if ((loaded = rf24_ack_load(this, &txn)) == 0) { return; }
+
+  rf24_txn_submit(this, &txn);
+  this->stats.ack_loaded += loaded;
+}
+
+/* Queues buf to go out with the ack of a coming frame on pipe_no, see the
+ * comment above. ttl_ms of 0 keeps it until it is sent. A full queue makes
+ * room by dropping its last entry when that one has a lower priority, and
+ * refuses buf otherwise. The queues belong to the thread servicing the
+ * radio, other threads hand payloads over with rf24_post_ack_payload();
+ * rf24_send_ack_on_pipe() and friends bypass them and should not be mixed
+ * in.
+ */
+int8_t rf24_queue_ack_payload(rf24_t * this, uint8_t pipe_no, const void * buf, uint8_t len, uint8_t priority, uint32_t ttl_ms)
+{
+  assert(this->ack_payload_enabled);
+
+  if (pipe_no > 5 || len == 0 || len > RF24_MAX_PAYLOAD) { return -1; }
+  if (rf24_ack_enqueue(this, pipe_no, buf, len, priority, ttl_ms ? rf24_now_ns() + ttl_ms * 1000000ULL : 0) == -1) { return -1; }
+
+  /* a pipe with nothing in the chip gets it right away */
+  rf24_ack_refill(this, 0);
+
+  return 0;
+}
+
+/* rf24_queue_ack_payload() from a thread other than the one servicing the
+ * radio. buf goes through a single producer, single consumer ring without
+ * locks or SPI traffic, and reaches the queue when the servicing thread next
+ * handles an IRQ or reads a payload; one thread may post. Returns -1 when
+ * the ring is full.
+ */
+int8_t rf24_post_ack_payload(rf24_t * this, uint8_t pipe_no, const void * buf, uint8_t len, uint8_t priority, uint32_t ttl_ms)
+{
+  uint32_t head = this->ack_post_head;
+  uint32_t tail = __atomic_load_n(&this->ack_post_tail, __ATOMIC_ACQUIRE);
+  struct rf24_ack_post * post;
+
+  assert(this->ack_payload_enabled);
+
+  if (pipe_no > 5 || len == 0 || len > RF24_MAX_PAYLOAD) { return -1; }
+  if (head - tail == RF24_ACK_POST_DEPTH) { return -1; }
+
+  post = &this->ack_posts[head & (RF24_ACK_POST_DEPTH - 1)];
+  memcpy(post->data, buf, len);
+  post->pipe       = pipe_no;
+  post->len        = len;
+  post->priority   = priority;
+  post->expires_ns = ttl_ms ? rf24_now_ns() + ttl_ms * 1000000ULL : 0;
+  __atomic_store_n(&this->ack_post_head, head + 1, __ATOMIC_RELEASE);
+
+  return 0;
+}
+
+/* Payloads still to go out on pipe_no, queued or already in the chip */
+uint8_t rf24_ack_queue_pending(rf24_t * this, uint8_t pipe_no)
+{
+  if (pipe_no > 5) { return 0; }
+  return this->ack_queues[pipe_no].count + this->ack_queues[pipe_no].in_chip;
+}
+
+/* Drops what is queued for pipe_no, see rf24_clear_ack_queues() */
+void rf24_clear_ack_queue(rf24_t * this, uint8_t pipe_no)
+{
+  if (pipe_no > 5) { return; }
+  rf24_clear_ack_queues(this, _BV(pipe_no));
+}
+
+/* Drops what is queued for the pipes in mask. The chip can only drop all of
+ * its TX FIFO, so when one of them has a payload in there it is flushed: the
+ * other pipes' payloads go back to the head of their queues and are loaded
+ * again in the same SPI message.
+ */
+void rf24_clear_ack_queues(rf24_t * this, uint8_t mask)
+{
+  struct rf24_ack_queue * queue;
+  rf24_txn_t txn;
+  uint8_t flush = 0, loaded, pipe;
+
+  for (pipe = 0; pipe < 6; pipe++) {
+    if (!(mask & _BV(pipe))) { continue; }
+    this->ack_queues[pipe].count = 0;
+    if (this->ack_queues[pipe].in_chip > 0) { flush = 1; }
+  }
+  if (!flush) { return; }
+
+  for (pipe = 0; pipe < 6; pipe++) {
+    queue = &this->ack_queues[pipe];
+    if (queue->in_chip > 0 && !(mask & _BV(pipe))) {
+      if (queue->count < RF24_ACK_QUEUE_DEPTH) {
+        queue->entries[queue->count++] = queue->loaded;
+      } else {
+        this->stats.ack_dropped++;
+      }
+    }
+    queue->in_chip = 0;
+  }
+
+  rf24_txn_init(&txn);
+  rf24_txn_add(&txn, FLUSH_TX, NULL, 0);
+  loaded = rf24_ack_load(this, &txn);
+  rf24_txn_submit(this, &txn);
+  this->stats.ack_loaded += loaded;
+}
+
+int8_t rf24_irq_wait(rf24_t * this, int32_t timeout_ms)
+{
+  uint64_t timestamp;
+  int8_t ret;
+
+  if ((ret = this->transport->irq_wait(this->transport_ctx, timeout_ms, &timestamp)) == 1) {
+    this->irq_ns = timestamp;
+  }
+  return ret;
+}
+
+void rf24_irq_poll(rf24_t * this, void(* callback)(void * radio))
+{
+  uint64_t timestamp;
+  int8_t ret;
+
+  /* the callback is expected to clear STATUS, the IRQ line stays asserted until it does;
+   * without one, received frames go to the RX ring and TX flags get cleared here
+   */
+  while ((ret = this->transport->irq_wait(this->transport_ctx, -1, &timestamp)) != -1) {
+    if (ret == 1) {
+      rf24_service_irq(this, timestamp, callback);
+    }
+  }
+
+  fprintf(stderr, "[rf24] Error waiting for irq on pin %d\n", this->irq_pin);
+}
+
+int32_t rf24_get_irq_fd(rf24_t * this, uint32_t * events)
+{
+  if (this->transport->irq_fd == NULL) { return -1; }
+
+  return this->transport->irq_fd(this->transport_ctx, events);
+}
+
+int16_t rf24_process(rf24_t * this, uint8_t max_events)
+{
+  uint64_t timestamp;
+  int16_t serviced = 0;
+  int8_t ret;
+
+  while (serviced < max_events) {
+    if ((ret = this->transport->irq_wait(this->transport_ctx, 0, &timestamp)) != 1) {
+      return ret == -1 && serviced == 0 ? -1 : serviced;
+    }
+
+    rf24_service_irq(this, timestamp, NULL);
+    serviced++;
+
+    /* without a ring RX_DR stays set for the caller, the line would not drop */
+    if (this->rx_ring == NULL) { break; }
+  }
+
+  return serviced;
+}
+
+/* One pass over an IRQ seen asserted at timestamp_ns: TX completions, the RX FIFO into the ring, then callback */
+void rf24_service_irq(rf24_t * this, uint64_t timestamp_ns, void(* callback)(void * radio))
+{
+  this->stats.irqs++;
+  this->irq_ns = timestamp_ns;
+  rf24_histogram_add(&this->stats.irq_latency, rf24_now_ns() - timestamp_ns);
+
+  if (this->tx_count > 0) {
+    rf24_handle_tx_irq(this);
+  }
+  if (this->rx_ring != NULL) {
+    rf24_fill_rx_ring(this);
+  }
+  /* payloads posted by other threads get their slots before the callback runs */
+  if (__atomic_load_n(&this->ack_post_head, __ATOMIC_ACQUIRE) != this->ack_post_tail) {
+    rf24_ack_refill(this, 0);
+  }
+  if (callback != NULL) {
+    callback(this);
+  } else if (this->tx_count == 0) {
+    /* nobody else looks at STATUS, leftover TX flags would keep the line asserted */
+    rf24_write_register(this, STATUS, _BV(TX_DS) | _BV(MAX_RT));
+  }
+}
+
+uint8_t rf24_send(rf24_t * this, void * buf, uint8_t len)
+{
+  struct iovec iov = { .iov_base = buf, .iov_len = len };
+
+  return rf24_sendv(this, &iov, 1);
+}
+
+uint8_t rf24_sendv(rf24_t * this, const struct iovec * iov, uint8_t iovcnt)
+{
+  rf24_txn_t txn;
+  uint64_t next, deadline, period, now, until;
+  uint8_t  status, config, len = 0, i;
+  uint8_t * payload;
+
+  /* the completion of a blocking send would be taken for the one of an asynchronous send */
+  assert(this->tx_count == 0);
+
+  /* time to write, CONFIG only needs touching when coming out of RX or power down */
+  config = ( rf24_cached_register(this, CONFIG) | _BV(PWR_UP) ) & ~_BV(PRIM_RX);
+
+  rf24_txn_init(&txn);
+  if (config != rf24_cached_register(this, CONFIG)) {
+    rf24_txn_write_register(this, &txn, CONFIG, config);
+  }
+  payload = rf24_txn_write_payloadv(this, &txn, W_TX_PAYLOAD, iov, iovcnt);
+  rf24_txn_submit(this, &txn);
+
+  for (i = 0; i < iovcnt; i++) { len += iov[i].iov_len; }
+
+  /* STATUS is clocked out before the payload goes in, TX_FULL means it was dropped */
+  if (payload[0] & _BV(TX_FULL)) { this->stats.tx_fifo_full++; }
+
+  rf24_tx_pulse(this);
+
+  /* the chip is done by the time all its retransmits would have failed, anything later is a timeout */
+  next     = this->tx_started + 1000ULL * rf24_send_time_us(this, len);
+  period   = 1000ULL * rf24_retry_period_us(this, len);
+  deadline = this->tx_started + 1000ULL * (rf24_max_rt_time_us(this, len) + RF24_TX_SLACK_US);
+
+  /* sleep on the IRQ line until TX_DS or MAX_RT shows up in STATUS, but no
+   * longer than until the first attempt should be acked and then one
+   * retransmit at a time: an RX_DR left pending holds the line asserted, and
+   * TX_DS makes no edge of its own. Without an IRQ line irq_wait() fails
+   * straight away and the same points in time are slept to.
+   */
+  status = 0;
+  while (! (status & ( _BV(TX_DS) | _BV(MAX_RT) ) ) && (now = rf24_now_ns()) < deadline ) {
+    until = next < deadline ? next : deadline;
+    if (until > now && rf24_irq_wait(this, (until - now + 999999) / 1000000) == -1) {
+      rf24_sleep_until(until);
+    }
+    if (rf24_now_ns() >= next) { next += period; }
+    status = rf24_get_status(this);
+  }
+
+  rf24_sync_status(this);
+
+  if (this->status.tx_ok) {
+    this->stats.tx_ok++;
+  } else if (this->status.tx_fail_retries) {
+    this->stats.tx_max_rt++;
+  } else {
+    this->stats.tx_timeouts++;
+  }
+  if (this->status.tx_ok || this->status.tx_fail_retries) {
+    rf24_histogram_add(&this->stats.send_latency, rf24_now_ns() - this->tx_started);
+  }
+
+  /* a payload that hit MAX_RT stays at the head of the TX FIFO, it would go out ahead of the next send */
+  if (!this->status.tx_ok) { rf24_flush_tx(this); }
+
+  return this->status.tx_ok;
+}
+
+/* Copies a payload into the next free slot and writes it to the TX FIFO in
+ * one SPI message, followed by FIFO_STATUS when fifo_status is given. Returns
+ * -1 without queueing anything when the chip reports the FIFO full.
+ */
+static int8_t rf24_tx_queue(rf24_t * this, uint8_t reg, void * buf, uint8_t len, rf24_send_callback_t callback, void * ctx, uint8_t * fifo_status)
+{
+  struct rf24_tx_slot * slot;
+  rf24_txn_t txn;
+  uint8_t config;
+  uint8_t * payload, * fifo = NULL;
+
+  assert(len <= RF24_MAX_PAYLOAD);
+
+  if (this->tx_count == RF24_TX_FIFO_DEPTH) { return -1; }
+
+  slot = &this->tx_slots[(this->tx_head + this->tx_count) % RF24_TX_FIFO_DEPTH];
+  slot->callback = callback;
+  slot->ctx      = ctx;
+  slot->len      = len;
+  slot->reg      = reg;
+  memcpy(slot->data, buf, len);
+
+  config = ( rf24_cached_register(this, CONFIG) | _BV(PWR_UP) ) & ~_BV(PRIM_RX);
+
+  rf24_txn_init(&txn);
+  if (config != rf24_cached_register(this, CONFIG)) {
+    rf24_txn_write_register(this, &txn, CONFIG, config);
+  }
+  payload = rf24_txn_write_payload(this, &txn, reg, slot->data, len);
+  if (fifo_status != NULL) {
+    fifo = rf24_txn_read_register(&txn, FIFO_STATUS);
+  }
+  rf24_txn_submit(this, &txn);
+
+  if (fifo != NULL) {
+    *fifo_status = fifo[1];
+  }
+
+  if (payload[0] & _BV(TX_FULL)) {
+    this->stats.tx_fifo_full++;
+    return -1;
+  }
 
-static uint64_t now(void) {
-  struct timeval now;
-  gettimeofday(&now, NULL);
-  return (now.tv_sec * 1000 + now.tv_usec/1000.0);
+  this->tx_count++;
+  return 0;
 }
 
-void rf24_open_reading_pipe(rf24_t * this, uint8_t pipe, uint64_t address)
+/* Reports the count oldest sends as finished, with tx_ok for all of them,
+ * and adds them to counter. Outside streaming the next payload is put on
+ * the air before any callback runs.
+ */
+static void rf24_tx_complete(rf24_t * this, uint8_t count, uint8_t tx_ok, uint32_t * counter)
 {
-  assert(pipe >= 0 && pipe <= 5);
+  struct rf24_tx_slot done[RF24_TX_FIFO_DEPTH];
+  uint64_t latency = rf24_now_ns() - this->tx_started;
+  uint8_t i;
 
-  if (pipe == 0) {
-    this->pipe0_address = address;
+  assert(count <= this->tx_count);
+
+  for (i = 0; i < count; i++) {
+    done[i] = this->tx_slots[this->tx_head];
+    this->tx_head = (this->tx_head + 1) % RF24_TX_FIFO_DEPTH;
+    this->tx_count--;
+    rf24_histogram_add(&this->stats.send_latency, latency);
   }
+  *counter += count;
 
-  /* all pipes have 5 bytes configurable address, pipe 0 has unique 5 byte address, other pipes share first 4 bytes. */
-  if (pipe == 0 || pipe == 1) {
-    rf24_write_address(this, pipe_address_registers[pipe], address);
-  } else {
-    rf24_write_register(this, pipe_address_registers[pipe], (uint8_t) address);
+  /* back to back payloads are timed from one completion to the next */
+  if (this->tx_streaming) {
+    this->tx_started = rf24_now_ns();
+  }
+
+  if (count > 0 && this->tx_count > 0 && !this->tx_streaming) {
+    this->tx_max_rt_run = 0;
+    rf24_tx_pulse(this);
+  }
+
+  /* last, the callbacks may well queue the next sends */
+  for (i = 0; i < count; i++) {
+    if (done[i].callback != NULL) {
+      done[i].callback(this, tx_ok, done[i].ctx);
+    }
   }
-  rf24_write_register(this, pipe_payload_size_registers[pipe], this->payload_size);
-  rf24_write_register(this, EN_RXADDR, rf24_read_register(this, EN_RXADDR) | _BV(pipe_enable_registers[pipe]));
 }
 
-void rf24_open_writing_pipe(rf24_t * this, uint64_t address)
+/* While streaming, FIFO_STATUS only tells an empty or a full TX FIFO apart
+ * from one holding one or two payloads. Everything beyond what may still be
+ * in the FIFO has been acked, so report those; the rest follows once the
+ * FIFO state is unambiguous again.
+ */
+static void rf24_tx_retire(rf24_t * this, uint8_t fifo_status)
 {
-  rf24_write_address(this, pipe_address_registers[0], address);
-  rf24_write_address(this, TX_ADDR, address);
-  rf24_write_register(this, pipe_payload_size_registers[0], this->payload_size);
+  uint8_t in_fifo = (fifo_status & _BV(TX_EMPTY)) ? 0 : ((fifo_status & _BV(FIFO_FULL)) ? 3 : 2);
+
+  if (this->tx_count > in_fifo) {
+    rf24_tx_complete(this, this->tx_count - in_fifo, 1, &this->stats.tx_ok);
+  }
 }
 
-void rf24_start_listening(rf24_t * this)
+/* Payloads in the TX FIFO while the chip is halted on MAX_RT: the writes the
+ * FIFO still accepts are counted, the caller flushes them again.
+ */
+static uint8_t rf24_tx_probe(rf24_t * this)
 {
-  rf24_write_register(this, CONFIG, rf24_read_register(this, CONFIG) | _BV(PWR_UP) | _BV(PRIM_RX));
-  rf24_write_register(this, STATUS, _BV(RX_DR) | _BV(TX_DS) | _BV(MAX_RT) );
+  rf24_txn_t txn;
+  uint8_t * writes[RF24_TX_FIFO_DEPTH];
+  uint8_t blank = 0, accepted = 0, i;
 
-  if (this->pipe0_address) {
-    rf24_write_address(this, RX_ADDR_P0, this->pipe0_address);
+  rf24_txn_init(&txn);
+  for (i = 0; i < RF24_TX_FIFO_DEPTH; i++) {
+    writes[i] = rf24_txn_write_payload(this, &txn, W_TX_PAYLOAD, &blank, 1);
   }
+  rf24_txn_submit(this, &txn);
 
-  gpio_write(this->ce_pin, GPIO_PIN_HIGH);
+  for (i = 0; i < RF24_TX_FIFO_DEPTH; i++) {
+    if (!(writes[i][0] & _BV(TX_FULL))) { accepted++; }
+  }
 
-  /* wait for the radio to come up (130us actually only needed) */
-  usleep(130);
+  return RF24_TX_FIFO_DEPTH - accepted;
 }
 
-void rf24_stop_listening(rf24_t * this)
+int8_t rf24_send_async(rf24_t * this, void * buf, uint8_t len, rf24_send_callback_t callback, void * ctx)
 {
-  gpio_write(this->ce_pin, GPIO_PIN_LOW);
-  rf24_flush_rx(this);
-  rf24_flush_tx(this);
+  /* streamed payloads go out back to back, there is no pulse per payload to hook into */
+  assert(!this->tx_streaming);
+
+  if (rf24_tx_queue(this, W_TX_PAYLOAD, buf, len, callback, ctx, NULL) == -1) {
+    return -1;
+  }
+
+  /* only the head goes on the air now, rf24_handle_tx_irq() starts the ones behind it */
+  if (this->tx_count == 1) {
+    this->tx_max_rt_run = 0;
+    rf24_tx_pulse(this);
+  }
+
+  return 0;
 }
 
-void rf24_dump(rf24_t * this)
+/* Streams with the payload written with W_TX_PAYLOAD_NOACK when noack is set */
+static int8_t rf24_stream_queue(rf24_t * this, uint8_t noack, void * buf, uint8_t len, rf24_send_callback_t callback, void * ctx)
 {
-  uint64_t addr, txaddr;
-  uint8_t status = rf24_get_status(this);
-  uint8_t i, reg;
+  uint8_t fifo_status;
 
-  fprintf(stderr, "[rf24] Device configuration\n");
-  fprintf(stderr, "[rf24] CE: %d CS: %d\n", this->ce_pin, this->csn_pin);
-  fprintf(stderr, "[rf24] P variant: %s\n", this->p_variant ? "yes" : "no");
-  fprintf(stderr, "[rf24] STATUS register: 0x%02x RX_DR=%x TX_DS=%x MAX_RT=%x RX_P_NO=%x TX_FULL=%x\n",
-      status,
-      (status & _BV(RX_DR))?  1:0,
-      (status & _BV(TX_DS))?  1:0,
-      (status & _BV(MAX_RT))? 1:0,
-      ((status >> RX_P_NO) & 0b111),
-      (status & _BV(TX_FULL))? 1:0
-      );
+  assert(this->tx_streaming || this->tx_count == 0);
 
-  for (i = 0; i < 6; i++) {
-    addr = rf24_read_address(this, pipe_address_registers[i]);
-    fprintf(stderr, "[rf24] RX_ADDR_P%d: %x %x %x %x %x\n", i, _BN(addr, 4), _BN(addr, 3), _BN(addr, 2), _BN(addr, 1), _BN(addr, 0));
+  /* the slots may be held by payloads the chip has long sent, find out */
+  if (this->tx_count == RF24_TX_FIFO_DEPTH) {
+    rf24_tx_retire(this, rf24_read_register(this, FIFO_STATUS));
   }
 
-  for (i = 0; i < 6; i++) {
-    reg = rf24_read_register(this, pipe_payload_size_registers[i]);
-    fprintf(stderr, "[rf24] RX_PW_P%d: 0x%02x\n", i, reg);
+  if (rf24_tx_queue(this, noack ? W_TX_PAYLOAD_NOACK : W_TX_PAYLOAD, buf, len, callback, ctx, &fifo_status) == -1) {
+    return -1;
   }
 
-  reg = rf24_read_register(this, EN_RXADDR);
-  for (i = 0; i < 6; i++) {
-    fprintf(stderr, "[rf24] ERX_P%d: %d\n", i, (reg & _BV(pipe_enable_registers[i])) >> pipe_enable_registers[i]);
+  /* with CE kept high the chip sends whatever gets into the FIFO, no pulse needed */
+  if (!this->tx_streaming) {
+    this->tx_streaming  = 1;
+    this->tx_max_rt_run = 0;
+    this->tx_started    = rf24_now_ns();
+    rf24_ce(this, GPIO_PIN_HIGH);
+  } else {
+    rf24_tx_retire(this, fifo_status);
   }
 
-  txaddr = rf24_read_address(this, TX_ADDR);
-  fprintf(stderr, "[rf24] TX_ADDR: %x %x %x %x %x\n", _BN(txaddr, 4), _BN(txaddr, 3), _BN(txaddr, 2), _BN(txaddr, 1), _BN(txaddr, 0));
-
-  fprintf(stderr, "[rf24] EN_RXADDR: 0x%02x\n", rf24_read_register(this, EN_RXADDR));
-  fprintf(stderr, "[rf24] RF_CH: 0x%02x\n", rf24_read_register(this, RF_CH));
-  fprintf(stderr, "[rf24] EN_AA: 0x%02x\n", rf24_read_register(this, EN_AA));
-  fprintf(stderr, "[rf24] RF_SETUP: 0x%02x\n", rf24_read_register(this, RF_SETUP));
-  fprintf(stderr, "[rf24] CONFIG: 0x%02x\n", rf24_read_register(this, CONFIG));
-  fprintf(stderr, "[rf24] DYNPD, FEATURE: 0x%02x 0x%02x\n", rf24_read_register(this, DYNPD), rf24_read_register(this, FEATURE));
-
-  reg = rf24_get_data_rate(this);
-  fprintf(stderr, "[rf24] Data rate: %s\n", reg == RF24_250KBPS ? "250KBPS" : ((reg == RF24_1MBPS) ? "1MBPS" : "2MBPS"));
-
-  reg = rf24_get_crc_length(this);
-  fprintf(stderr, "[rf24] CRC: %s\n", reg == RF24_CRC_DISABLED ? "Disabled" : ((reg == RF24_CRC_8) ? "8bit" : "16bit"));
+  return 0;
 }
 
-static uint8_t rf24_write_payload(rf24_t * this, uint8_t reg, void * buf, uint8_t len)
+int8_t rf24_stream_write(rf24_t * this, void * buf, uint8_t len, rf24_send_callback_t callback, void * ctx)
 {
-  uint8_t status, blanks;
-  uint8_t * pos;
+  return rf24_stream_queue(this, 0, buf, len, callback, ctx);
+}
 
-  if (!this->dynamic_payloads_enabled) { assert(len <= this->payload_size); }
-  assert(reg == W_TX_PAYLOAD || this->ack_payload_enabled);
+/* The payload goes out without asking for an ack and is done once sent, see rf24_enable_dynamic_ack() */
+int8_t rf24_stream_write_noack(rf24_t * this, void * buf, uint8_t len, rf24_send_callback_t callback, void * ctx)
+{
+  assert(rf24_cached_register(this, FEATURE) & _BV(EN_DYN_ACK));
+  return rf24_stream_queue(this, 1, buf, len, callback, ctx);
+}
 
-  blanks = this->dynamic_payloads_enabled ? 0 : this->payload_size - len;
+int8_t rf24_stream_end(rf24_t * this, int32_t timeout_ms)
+{
+  uint64_t started = rf24_now_ns();
+  uint32_t elapsed;
+  uint8_t left;
+
+  while (this->tx_count > 0 && ( (elapsed = (rf24_now_ns() - started) / 1000000) < (uint32_t) timeout_ms ) ) {
+    /* without an IRQ line irq_wait() fails and STATUS gets polled */
+    if (rf24_irq_wait(this, timeout_ms - elapsed) != 0) {
+      rf24_handle_tx_irq(this);
+    }
+  }
 
-  /* send the data out */
-  gpio_write(this->csn_pin, GPIO_PIN_LOW);
-  status = spi_transfer(this->spi, reg);
+  rf24_ce(this, GPIO_PIN_LOW);
+  this->tx_streaming = 0;
 
-  pos = (uint8_t *) buf;
-  while (len--) {
-    spi_transfer(this->spi, *pos++);
-  }
-  if (reg == W_TX_PAYLOAD) {
-    while (blanks--) {
-      spi_transfer(this->spi, 0x0);
-    }
+  /* whatever did not make it in time is dropped and reported as failed */
+  left = this->tx_count;
+  if (left > 0) {
+    rf24_flush_tx(this);
+    rf24_write_register(this, STATUS, _BV(TX_DS) | _BV(MAX_RT));
+    rf24_tx_complete(this, left, 0, &this->stats.tx_timeouts);
   }
-  gpio_write(this->csn_pin, GPIO_PIN_HIGH);
-  return status;
+
+  return left > 0 ? -1 : 0;
 }
 
-void rf24_send_ack_on_pipe(rf24_t * this, uint8_t pipe_no, void * buf, uint8_t len)
+static void rf24_burst_done(rf24_t * radio, uint8_t tx_ok, void * ctx)
 {
-  rf24_write_payload(this, (W_ACK_PAYLOAD | (pipe_no & 0b111)), buf, len);
+  uint32_t * acked = (uint32_t *) ctx;
+
+  (void) radio;
+  if (tx_ok) { (*acked)++; }
 }
 
-void rf24_irq_poll(rf24_t * this, void(* callback)(void * radio))
+int32_t rf24_send_burst(rf24_t * this, void * payloads, uint8_t len, uint32_t count)
 {
-  assert(this->irq_pin);
-  if (gpio_poll(this->irq_pin, GPIO_EDGE_FALLING, callback, (void *) this) == -1) {
-    fprintf(stderr, "[rf24] Error registering irq callback on pin %d\n", this->irq_pin);
+  uint8_t * next = (uint8_t *) payloads;
+  uint32_t acked = 0, written = 0;
+  int8_t ret;
+
+  while (written < count) {
+    if (rf24_stream_write(this, next, len, rf24_burst_done, &acked) == 0) {
+      written++;
+      next += len;
+      continue;
+    }
+
+    /* TX FIFO full, wait for the chip to make room */
+    ret = rf24_irq_wait(this, this->tx_timeout);
+    if (ret == 0) { break; }
+    rf24_handle_tx_irq(this);
   }
+
+  rf24_stream_end(this, this->tx_timeout);
+
+  return acked;
 }
 
-uint8_t rf24_send(rf24_t * this, void * buf, uint8_t len)
+uint8_t rf24_handle_tx_irq(rf24_t * this)
 {
-  uint64_t sent_at;
-  uint32_t timeout;
-  uint8_t  status;
+  struct rf24_tx_slot * slot;
+  rf24_txn_t txn;
+  uint8_t * status, * fifo;
+  uint8_t in_fifo, resend, i;
+
+  /* writing TX_DS clears it, the STATUS clocked out meanwhile is the one from
+   * before; MAX_RT stays, it keeps the chip halted until dealt with
+   */
+  rf24_txn_init(&txn);
+  status = rf24_txn_write_register(this, &txn, STATUS, _BV(TX_DS));
+  fifo   = rf24_txn_read_register(&txn, FIFO_STATUS);
+  rf24_txn_submit(this, &txn);
 
-  /* time to write */
-  rf24_write_register(this, CONFIG, ( rf24_read_register(this, CONFIG) | _BV(PWR_UP) ) & ~_BV(PRIM_RX) );
-  rf24_write_payload(this, W_TX_PAYLOAD, buf, len);
+  if (status[0] & _BV(TX_DS)) {
+    this->tx_max_rt_run = 0;
+  }
 
-  /* Activate the TX mode for at least 10us (nRF24L01P_Product_spec, page 43 - Fig. 16) */
-  gpio_write(this->ce_pin, GPIO_PIN_HIGH);
-  usleep(10);
-  gpio_write(this->ce_pin, GPIO_PIN_LOW);
+  if (!(status[0] & _BV(MAX_RT))) {
+    if (this->tx_streaming) {
+      rf24_tx_retire(this, fifo[1]);
+    } else if (this->tx_count > 0 && (status[0] & _BV(TX_DS))) {
+      rf24_tx_complete(this, 1, 1, &this->stats.tx_ok);
+    }
+    return status[0];
+  }
 
-  /* FIXME: looks like according section 7.7, there is Tstdby 130us before Time on air and TX_DS irq, so we could sleep */
-  /* now poll for finished tx */
-  timeout = this->tx_timeout;
-  sent_at = now();
+  /* the head payload failed and is still in the FIFO, give it another round of retries while it has some left */
+  resend = this->tx_count > 0 && this->tx_max_rt_run < this->tx_resend;
+  this->tx_max_rt_run++;
 
-  do {
-    status = rf24_read_register(this, OBSERVE_TX);
-  } while (! (status & ( _BV(TX_DS) | _BV(MAX_RT) ) ) && ( (now() - sent_at) < timeout ) );
+  if (resend) {
+    this->stats.tx_resends++;
+    rf24_write_register(this, STATUS, _BV(MAX_RT));
+    if (!this->tx_streaming) { rf24_tx_pulse(this); }
+    return status[0];
+  }
 
-  rf24_sync_status(this);
-  return this->status.tx_ok;
+  /* whatever is ahead of the failed payload made it */
+  if (!this->tx_streaming || this->tx_count <= 1) {
+    in_fifo = this->tx_count;
+  } else if (fifo[1] & _BV(FIFO_FULL)) {
+    in_fifo = RF24_TX_FIFO_DEPTH;
+  } else {
+    in_fifo = rf24_tx_probe(this);
+  }
+  if (in_fifo > this->tx_count) { in_fifo = this->tx_count; }
+  rf24_tx_complete(this, this->tx_count - in_fifo, 1, &this->stats.tx_ok);
+
+  /* flush the failed payload and put back the ones queued behind it */
+  rf24_txn_init(&txn);
+  rf24_txn_add(&txn, FLUSH_TX, NULL, 0);
+  for (i = 1; i < this->tx_count; i++) {
+    slot = &this->tx_slots[(this->tx_head + i) % RF24_TX_FIFO_DEPTH];
+    rf24_txn_write_payload(this, &txn, slot->reg, slot->data, slot->len);
+  }
+  rf24_txn_write_register(this, &txn, STATUS, _BV(MAX_RT));
+  rf24_txn_submit(this, &txn);
+
+  this->tx_max_rt_run = 0;
+  if (this->tx_count > 0) {
+    rf24_tx_complete(this, 1, 0, &this->stats.tx_max_rt);
+  }
+
+  return status[0];
 }
 
 void rf24_sync_status(rf24_t * this)
 {
-  uint8_t status  = rf24_read_register(this, STATUS) & (_BV(RX_DR) | _BV(TX_DS) | _BV(MAX_RT));
-  uint8_t pipe_no = (status >> RX_P_NO) & 0b111;
+  rf24_txn_t txn;
+  uint8_t * reg_status, * dyn_len;
+  uint8_t status, pipe_no;
+
+  rf24_txn_init(&txn);
+  reg_status = rf24_txn_read_register(&txn, STATUS);
+  dyn_len    = this->dynamic_payloads_enabled == 1 ? rf24_txn_add(&txn, R_RX_PL_WID, NULL, 1) : NULL;
+  rf24_txn_submit(this, &txn);
+
+  status  = reg_status[1] & (_BV(RX_DR) | _BV(TX_DS) | _BV(MAX_RT));
+  pipe_no = (status >> RX_P_NO) & 0b111;
 
   this->status.tx_ok                 = status & _BV(TX_DS);
   this->status.tx_fail_retries       = status & _BV(MAX_RT);
   this->status.rx_data_available     = status & _BV(RX_DR);
-  this->status.rx_dyn_data_len       = this->dynamic_payloads_enabled == 1 ? rf24_get_dynamic_payload_size(this) : 0;
+  this->status.rx_dyn_data_len       = dyn_len != NULL ? dyn_len[1] : 0;
   this->status.rx_data_len           = this->dynamic_payloads_enabled == 1 ? 0 : this->payload_size;
   this->status.rx_data_pipe          = pipe_no;
 }
@@ -229,27 +1419,254 @@ void rf24_reset_status(rf24_t * this)
   memset(&(this->status), 0, sizeof(this->status));
 }
 
+void rf24_get_stats(rf24_t * this, rf24_stats_t * stats)
+{
+  /* a plain copy; taken from another thread it may be a few increments behind */
+  memcpy(stats, &this->stats, sizeof(rf24_stats_t));
+}
+
+void rf24_reset_stats(rf24_t * this)
+{
+  memset(&this->stats, 0, sizeof(rf24_stats_t));
+}
+
 uint8_t rf24_receive(rf24_t * this, void * buf, uint8_t len)
 {
-  uint8_t blanks;
-  uint8_t * pos;
+  rf24_txn_t txn;
+  uint8_t * payload, * fifo_status;
+  uint8_t blanks, pipe;
+  uint64_t read_at;
 
   if (!this->dynamic_payloads_enabled) { assert(len <= this->payload_size); }
   blanks = this->dynamic_payloads_enabled == 1 ? 0 : this->payload_size - len;
 
-  gpio_write(this->csn_pin, GPIO_PIN_LOW);
-  spi_transfer(this->spi, R_RX_PAYLOAD);
+  rf24_txn_init(&txn);
+  payload     = rf24_txn_add(&txn, R_RX_PAYLOAD, NULL, len + blanks);
+  fifo_status = rf24_txn_read_register(&txn, FIFO_STATUS);
+  rf24_txn_submit(this, &txn);
+  read_at = rf24_now_ns();
+
+  memcpy(buf, payload + 1, len);
+
+  /* the STATUS clocked out with the command names the pipe of the payload read, 7 when there was none */
+  pipe = (payload[0] >> RX_P_NO) & 0b111;
+  if (pipe != 7) {
+    rf24_ack_sent(this, pipe);
+    this->stats.rx_payloads++;
+    this->status.rx_edge_ns = this->irq_ns;
+    this->status.rx_read_ns = read_at;
+    if (this->irq_ns) { rf24_histogram_add(&this->stats.rx_latency, read_at - this->irq_ns); }
+  }
+  if (fifo_status[1] & _BV(RX_EMPTY))    { this->irq_ns = 0; }
+  rf24_ack_refill(this, fifo_status[1] & _BV(TX_EMPTY));
+
+  return fifo_status[1] & _BV(RX_EMPTY);
+}
+
+/* A round speculatively reads as many frames as the FIFO can hold in a
+ * single SPI message: for each one the payload width, whose STATUS tells the
+ * pipe (7 once the FIFO is empty), and a full 32 byte payload read into
+ * bufs[i]; FIFO_STATUS at the end says whether another round is needed.
+ * Where every command costs its own chip select frame, rounds read one frame.
+ * Returns the frames read, with their pipe and length in found, and how the
+ * FIFO was left in state.
+ *
+ * With clear set the round starts by clearing RX_DR. A frame landing after
+ * that raises it again, but the ones already in the FIFO do not: the caller
+ * only sets clear while it can still take RF24_RX_FIFO_DEPTH frames, this
+ * round included, so it never stops with a frame left behind without an
+ * IRQ. A caller that stops early leaves RX_DR set, and the IRQ fires again.
+ */
+static uint8_t rf24_rx_round(rf24_t * this, uint8_t * bufs[], uint8_t batch, uint8_t clear, struct rf24_rx_found * found, uint8_t * state)
+{
+  rf24_txn_t txn;
+  uint8_t * widths[RF24_RX_FIFO_DEPTH], * fifo_status;
+  uint8_t dynamic = rf24_cached_register(this, FEATURE) & _BV(EN_DPL);
+  uint8_t read, pipe, len, invalid = 0, i;
+
+  assert(batch <= RF24_RX_FIFO_DEPTH);
+
+  rf24_txn_init(&txn);
+  if (clear) { rf24_txn_write_register(this, &txn, STATUS, _BV(RX_DR)); }
+  for (i = 0; i < batch; i++) {
+    widths[i] = rf24_txn_add(&txn, dynamic ? R_RX_PL_WID : NOP, NULL, dynamic ? 1 : 0);
+    rf24_txn_add_buf(&txn, bufs[i], R_RX_PAYLOAD, RF24_MAX_PAYLOAD);
+  }
+  fifo_status = rf24_txn_read_register(&txn, FIFO_STATUS);
+  rf24_txn_submit(this, &txn);
+
+  for (read = 0; read < batch; read++) {
+    pipe = (widths[read][0] >> RX_P_NO) & 0b111;
+    if (pipe > 5) { break; }
+
+    if (dynamic && (rf24_cached_register(this, DYNPD) & _BV(pipe))) {
+      len = widths[read][1];
+    } else {
+      len = rf24_cached_register(this, pipe_payload_size_registers[pipe]);
+    }
+
+    /* a width over 32 means a corrupt frame, the datasheet has the whole FIFO flushed */
+    if (len == 0 || len > RF24_MAX_PAYLOAD) {
+      invalid = 1;
+      break;
+    }
+
+    found[read].pipe = pipe;
+    found[read].len  = len;
+    rf24_ack_sent(this, pipe);
+  }
+
+  /* the frames read ahead of a corrupt one count all the same */
+  this->stats.rx_payloads += read;
+  if (read == RF24_RX_FIFO_DEPTH) { this->stats.rx_fifo_full++; }
+  rf24_ack_refill(this, fifo_status[1] & _BV(TX_EMPTY));
+
+  if (invalid) {
+    this->stats.rx_invalid++;
+    rf24_flush_rx(this);
+    *state = RF24_RX_FLUSHED;
+    return read;
+  }
+
+  if (fifo_status[1] & _BV(RX_EMPTY)) {
+    *state = RF24_RX_EMPTY;
+  } else {
+    *state = read == batch ? RF24_RX_MORE : RF24_RX_EMPTY;
+  }
+  return read;
+}
+
+/* Stamps a payload read at read_at with the edge of the IRQ that announced it */
+static uint64_t rf24_rx_stamp(rf24_t * this, uint64_t read_at)
+{
+  if (this->irq_ns) { rf24_histogram_add(&this->stats.rx_latency, read_at - this->irq_ns); }
+  return this->irq_ns;
+}
 
-  pos = (uint8_t *) buf;
-  while (len--) {
-    *pos++ = spi_transfer(this->spi, 0xFF);
+int8_t rf24_receive_all(rf24_t * this, rf24_frame_t * frames, uint8_t max)
+{
+  struct rf24_rx_found found[RF24_RX_FIFO_DEPTH];
+  uint8_t scratch[RF24_RX_FIFO_DEPTH][1 + RF24_MAX_PAYLOAD];
+  uint8_t * bufs[RF24_RX_FIFO_DEPTH] = { scratch[0], scratch[1], scratch[2] };
+  rf24_frame_t * frame;
+  uint8_t count = 0, state = RF24_RX_MORE, batch, read, i;
+  uint64_t read_at;
+
+  while (state == RF24_RX_MORE) {
+    batch = this->transport->csn == NULL ? RF24_RX_FIFO_DEPTH : 1;
+    if (batch > max - count) { batch = max - count; }
+    if (batch == 0) { break; }
+
+    read    = rf24_rx_round(this, bufs, batch, max - count >= RF24_RX_FIFO_DEPTH, found, &state);
+    read_at = rf24_now_ns();
+
+    for (i = 0; i < read; i++) {
+      frame = &frames[count++];
+      frame->edge_ns      = rf24_rx_stamp(this, read_at);
+      frame->timestamp_ns = read_at;
+      frame->pipe = found[i].pipe;
+      frame->len  = found[i].len;
+      memcpy(frame->data, bufs[i] + 1, found[i].len);
+    }
   }
-  while (blanks--) {
-    spi_transfer(this->spi, 0xFF);
+
+  /* frames landing from now on raise an IRQ of their own */
+  if (state != RF24_RX_MORE) { this->irq_ns = 0; }
+
+  return count;
+}
+
+/* Slots are taken by the receiving thread only, but may be released from any other */
+static int8_t rf24_rx_slot_take(rf24_t * this)
+{
+  uint32_t used = __atomic_load_n(&this->rx_slots_used, __ATOMIC_ACQUIRE);
+  uint8_t slot;
+
+  if (used == (1U << RF24_RX_SLOTS) - 1) { return -1; }
+
+  slot = __builtin_ctz(~used);
+  __atomic_fetch_or(&this->rx_slots_used, 1U << slot, __ATOMIC_ACQ_REL);
+  return slot;
+}
+
+static void rf24_rx_slot_put(rf24_t * this, uint8_t slot)
+{
+  __atomic_fetch_and(&this->rx_slots_used, ~(1U << slot), __ATOMIC_RELEASE);
+}
+
+/* Drains the RX FIFO like rf24_receive_all(), but the payloads are clocked
+ * straight into free slots of the radio and handed out as views. A payload
+ * stays in the FIFO while all slots are held, with RX_DR still set, so the
+ * IRQ keeps firing until rf24_release_view() made room for it.
+ */
+int8_t rf24_receive_views(rf24_t * this, rf24_rx_view_t * views, uint8_t max)
+{
+  struct rf24_rx_found found[RF24_RX_FIFO_DEPTH];
+  uint8_t * bufs[RF24_RX_FIFO_DEPTH];
+  int8_t slots[RF24_RX_FIFO_DEPTH];
+  rf24_rx_view_t * view;
+  uint8_t count = 0, state = RF24_RX_MORE, batch, room, read, i;
+  uint64_t read_at;
+
+  while (state == RF24_RX_MORE) {
+    batch = this->transport->csn == NULL ? RF24_RX_FIFO_DEPTH : 1;
+    if (batch > max - count) { batch = max - count; }
+
+    /* slots only come back meanwhile, what is free now is the least this call can still take */
+    room = __builtin_popcount(~__atomic_load_n(&this->rx_slots_used, __ATOMIC_ACQUIRE) & ((1U << RF24_RX_SLOTS) - 1));
+    if (room > max - count) { room = max - count; }
+
+    for (i = 0; i < batch && (slots[i] = rf24_rx_slot_take(this)) != -1; i++) {
+      bufs[i] = this->rx_slots[slots[i]].raw;
+    }
+    if ((batch = i) == 0) { break; }
+
+    read    = rf24_rx_round(this, bufs, batch, room >= RF24_RX_FIFO_DEPTH, found, &state);
+    read_at = rf24_now_ns();
+
+    for (i = 0; i < read; i++) {
+      view = &views[count++];
+      view->data         = bufs[i] + 1;
+      view->edge_ns      = rf24_rx_stamp(this, read_at);
+      view->timestamp_ns = read_at;
+      view->pipe = found[i].pipe;
+      view->len  = found[i].len;
+      view->slot = slots[i];
+    }
+    /* the speculative reads that found the FIFO empty give their slots back */
+    for (i = read; i < batch; i++) {
+      rf24_rx_slot_put(this, slots[i]);
+    }
   }
-  gpio_write(this->csn_pin, GPIO_PIN_HIGH);
 
-  return rf24_read_register(this, FIFO_STATUS) & _BV(RX_EMPTY);
+  if (state != RF24_RX_MORE) { this->irq_ns = 0; }
+
+  return count;
+}
+
+void rf24_release_view(rf24_t * this, const rf24_rx_view_t * view)
+{
+  assert(view->slot < RF24_RX_SLOTS);
+  rf24_rx_slot_put(this, view->slot);
+}
+
+void rf24_set_rx_ring(rf24_t * this, struct rf24_ring * ring)
+{
+  this->rx_ring = ring;
+}
+
+static void rf24_fill_rx_ring(rf24_t * this)
+{
+  rf24_frame_t frames[RF24_RX_FIFO_DEPTH];
+  int8_t count, i;
+
+  /* the chip's FIFO is emptied either way, frames the ring has no room for are counted there */
+  do {
+    count = rf24_receive_all(this, frames, RF24_RX_FIFO_DEPTH);
+    for (i = 0; i < count; i++) {
+      rf24_ring_push(this->rx_ring, &frames[i]);
+    }
+  } while (count == RF24_RX_FIFO_DEPTH);
 }
 
 uint8_t rf24_data_available(rf24_t * this)
@@ -281,10 +1698,7 @@ uint8_t rf24_data_available_on_pipe(rf24_t * this, uint8_t * pipe_number)
     /* FIXME: Should this REALLY be cleared now?  Or wait until we
      * actually READ the payload?
      */
-    rf24_write_register(this, STATUS, _BV(RX_DR));
-    if (status & _BV(TX_DS)) {
-      rf24_write_register(this, STATUS, _BV(TX_DS));
-    }
+    rf24_write_register(this, STATUS, _BV(RX_DR) | (status & _BV(TX_DS)));
   }
 
   return result;
@@ -305,39 +1719,92 @@ rf24_t * rf24_new(char * spi_dev, uint8_t ce_pin, uint8_t irq_pin)
 }
 
 uint8_t rf24_initialize(rf24_t * this, char * spi_dev, uint8_t ce_pin, uint8_t irq_pin)
+{
+  /* spidev0.0 and spidev0.1 drive CE0 (GPIO 8) and CE1 (GPIO 7) themselves */
+  if (strcmp(spi_dev, RF24_SPI_DEV_0) == 0 || strcmp(spi_dev, RF24_SPI_DEV_1) == 0) {
+    return rf24_initialize_csn(this, spi_dev, ce_pin, irq_pin, RF24_CSN_HW);
+  } else {
+    return rf24_initialize_csn(this, spi_dev, ce_pin, irq_pin, 7);
+  }
+}
+
+static void rf24_defaults(rf24_t * this)
 {
   memset(this, 0, sizeof(rf24_t));
 
-  this->ce_pin = ce_pin;
-  this->irq_pin = irq_pin;
   this->tx_timeout = 500;
   this->payload_size = 32;
+  this->spi.fd = -1;
+  this->ce_line.fd = -1;
+  this->csn_line.fd = -1;
+  this->irq_line.fd = -1;
+}
 
-  if (strcmp(spi_dev, RF24_SPI_DEV_0) == 0) {
-    this->csn_pin = 8;
-  } else {
-    this->csn_pin = 7;
+uint8_t rf24_initialize_csn(rf24_t * this, char * spi_dev, uint8_t ce_pin, uint8_t irq_pin, uint8_t csn_pin)
+{
+  rf24_defaults(this);
+
+  this->ce_pin = ce_pin;
+  this->csn_pin = csn_pin;
+  this->irq_pin = irq_pin;
+
+  if (spi_open(&this->spi, spi_dev) == -1) {
+    return -1;
   }
 
-  if ((this->spi = spi_open(spi_dev)) == -1) {
+  /* value files stay open for the lifetime of the radio */
+  if (gpio_line_open(&this->ce_line, this->ce_pin, GPIO_PIN_OUTPUT) == (uint8_t) -1) {
     return -1;
   }
+  if (this->csn_pin != RF24_CSN_HW) {
+    if (gpio_line_open(&this->csn_line, this->csn_pin, GPIO_PIN_OUTPUT) == (uint8_t) -1) {
+      return -1;
+    }
+    this->transport = &rf24_spidev_transport;
+  } else {
+    this->transport = &rf24_spidev_hw_cs_transport;
+  }
+  this->transport_ctx = this;
 
-  gpio_export_wait(this->ce_pin);
-  gpio_export_wait(this->csn_pin);
-  gpio_set_direction(this->ce_pin, GPIO_PIN_OUTPUT);
-  gpio_set_direction(this->csn_pin, GPIO_PIN_OUTPUT);
+  if (this->irq_pin) {
+    if (gpio_line_open_edge(&this->irq_line, this->irq_pin, GPIO_EDGE_FALLING) == (uint8_t) -1) {
+      return -1;
+    }
+  }
 
   /* Minimum ideal SPI bus speed is 2x data rate
    * If we assume 2Mbs data rate and 16Mhz clock, a
    * divider of 4 is the minimum we want.
    * CLK:BUS 8Mhz:2Mhz, 16Mhz:4Mhz, or 20Mhz:5Mhz
    */
-  spi_config(this->spi, 8, 8000000, 0);
+  spi_config(&this->spi, 8, 8000000, 0);
+
+  rf24_ce(this, GPIO_PIN_LOW);
+  if (this->transport->csn != NULL) {
+    this->transport->csn(this->transport_ctx, GPIO_PIN_HIGH);
+  }
+
+  return rf24_setup(this);
+}
+
+uint8_t rf24_initialize_transport(rf24_t * this, const rf24_transport_t * transport, void * ctx)
+{
+  rf24_defaults(this);
 
-  gpio_write(this->ce_pin, GPIO_PIN_LOW);
-  gpio_write(this->csn_pin, GPIO_PIN_HIGH);
+  this->csn_pin = RF24_CSN_HW;
+  this->transport = transport;
+  this->transport_ctx = ctx;
 
+  rf24_ce(this, GPIO_PIN_LOW);
+  if (this->transport->csn != NULL) {
+    this->transport->csn(this->transport_ctx, GPIO_PIN_HIGH);
+  }
+
+  return rf24_setup(this);
+}
+
+static uint8_t rf24_setup(rf24_t * this)
+{
   /* Must allow the radio time to settle else configuration bits will not necessarily stick.
    * This is actually only required following power up but some settling time also appears to
    * be required after resets too. For full coverage, we'll always assume the worst.
@@ -346,8 +1813,9 @@ uint8_t rf24_initialize(rf24_t * this, char * spi_dev, uint8_t ce_pin, uint8_t i
    * WARNING: Delay is based on P-variant whereby non-P *may* require different timing.
    */
 
-  /* enforce chip reset */
+  /* enforce chip reset and load the register shadow */
   rf24_reset(this);
+  rf24_resync(this);
 
   usleep(5000);
 
@@ -398,7 +1866,10 @@ uint8_t rf24_delete(rf24_t * this)
 {
   assert(this != NULL);
 
-  if (this->spi != -1) { spi_close(this->spi); }
+  if (this->spi.fd != -1) { spi_close(&this->spi); }
+  gpio_line_close(&this->ce_line);
+  gpio_line_close(&this->csn_line);
+  gpio_line_close(&this->irq_line);
 
   free(this);
   this = NULL;
@@ -410,10 +1881,7 @@ static uint8_t rf24_read_register(rf24_t * this, uint8_t reg)
 {
   uint8_t value;
 
-  gpio_write(this->csn_pin, GPIO_PIN_LOW);
-  spi_transfer(this->spi, R_REGISTER | ( REGISTER_MASK & reg ) );
-  value = spi_transfer(this->spi, 0xFF);
-  gpio_write(this->csn_pin, GPIO_PIN_HIGH);
+  rf24_command(this, R_REGISTER | ( REGISTER_MASK & reg ), NULL, &value, 1);
 
   return value;
 }
@@ -421,74 +1889,95 @@ static uint8_t rf24_read_register(rf24_t * this, uint8_t reg)
 static uint64_t rf24_read_address(rf24_t * this, uint8_t pipe_reg)
 {
   uint64_t address = 0;
-  uint8_t * cur    = (uint8_t *) &address;
-  uint8_t len      = 5;
 
-  gpio_write(this->csn_pin, GPIO_PIN_LOW);
-  spi_transfer(this->spi, R_REGISTER | (REGISTER_MASK & pipe_reg));
-  while (len--) {
-    *cur++ = spi_transfer(this->spi, 0xFF);
-  }
-  gpio_write(this->csn_pin, GPIO_PIN_HIGH);
+  rf24_command(this, R_REGISTER | (REGISTER_MASK & pipe_reg), NULL, &address, 5);
 
   return address;
 }
 
-static uint8_t rf24_write_address(rf24_t * this, uint8_t pipe_reg, uint64_t address)
+static void rf24_unmask_irqs(rf24_t * this)
+{
+  rf24_write_register(this, CONFIG, rf24_cached_register(this, CONFIG) & ~( _BV(MASK_RX_DR) | _BV(MASK_TX_DS) | _BV(MASK_MAX_RT) ));
+}
+
+static uint8_t rf24_write_register(rf24_t * this, uint8_t reg, uint8_t value)
+{
+  if (rf24_is_shadowed(reg)) {
+    this->regs[reg] = value;
+  }
+  return rf24_command(this, W_REGISTER | ( REGISTER_MASK & reg ), &value, NULL, 1);
+}
+
+static uint8_t rf24_is_shadowed(uint8_t reg)
 {
-  uint8_t * cur      = (uint8_t *) &address;
-  uint8_t   addr_len = 5;
-  uint8_t   status;
+  uint8_t i;
 
-  gpio_write(this->csn_pin, GPIO_PIN_LOW);
-  status = spi_transfer(this->spi, W_REGISTER | (REGISTER_MASK & pipe_reg));
-  while (addr_len--) {
-    spi_transfer(this->spi, *cur++);
+  for (i = 0; i < sizeof(shadowed_registers); i++) {
+    if (shadowed_registers[i] == reg) { return 1; }
   }
-  gpio_write(this->csn_pin, GPIO_PIN_HIGH);
+  return 0;
+}
 
-  return status;
+static uint8_t rf24_cached_register(rf24_t * this, uint8_t reg)
+{
+  assert(rf24_is_shadowed(reg));
+  return this->regs[reg];
 }
 
-static void rf24_unmask_irqs(rf24_t * this)
+void rf24_resync(rf24_t * this)
 {
-  rf24_write_register(this, CONFIG, rf24_read_register(this, CONFIG) & ~( _BV(MASK_RX_DR) | _BV(MASK_TX_DS) | _BV(MASK_MAX_RT) ));
+  rf24_txn_t txn;
+  uint8_t * values[sizeof(shadowed_registers)];
+  uint8_t i;
+
+  rf24_txn_init(&txn);
+  for (i = 0; i < sizeof(shadowed_registers); i++) {
+    values[i] = rf24_txn_read_register(&txn, shadowed_registers[i]);
+  }
+  rf24_txn_submit(this, &txn);
+
+  for (i = 0; i < sizeof(shadowed_registers); i++) {
+    this->regs[shadowed_registers[i]] = values[i][1];
+  }
 }
 
-static uint8_t rf24_write_register(rf24_t * this, uint8_t reg, uint8_t value)
+uint8_t rf24_verify(rf24_t * this)
 {
-  uint8_t status;
+  rf24_txn_t txn;
+  uint8_t * values[sizeof(shadowed_registers)];
+  uint8_t i, mismatches = 0;
 
-  gpio_write(this->csn_pin, GPIO_PIN_LOW);
-  status = spi_transfer(this->spi, W_REGISTER | ( REGISTER_MASK & reg ) );
-  spi_transfer(this->spi, value);
-  gpio_write(this->csn_pin, GPIO_PIN_HIGH);
+  rf24_txn_init(&txn);
+  for (i = 0; i < sizeof(shadowed_registers); i++) {
+    values[i] = rf24_txn_read_register(&txn, shadowed_registers[i]);
+  }
+  rf24_txn_submit(this, &txn);
+
+  for (i = 0; i < sizeof(shadowed_registers); i++) {
+    if (this->regs[shadowed_registers[i]] != values[i][1]) {
+      fprintf(stderr, "[rf24] register 0x%02x is 0x%02x, expected 0x%02x\n", shadowed_registers[i], values[i][1], this->regs[shadowed_registers[i]]);
+      mismatches++;
+    }
+  }
 
-  return status;
+  return mismatches;
 }
 
 uint8_t rf24_get_dynamic_payload_size(rf24_t * this)
 {
   uint8_t result = 0;
-  gpio_write(this->csn_pin, GPIO_PIN_LOW);
-  spi_transfer(this->spi, R_RX_PL_WID);
-  result = spi_transfer(this->spi, 0xff);
-  gpio_write(this->csn_pin, GPIO_PIN_HIGH);
+  rf24_command(this, R_RX_PL_WID, NULL, &result, 1);
   return result;
 }
 
 uint8_t rf24_get_status(rf24_t * this)
 {
-  uint8_t status;
-  gpio_write(this->csn_pin, GPIO_PIN_LOW);
-  status = spi_transfer(this->spi, NOP);
-  gpio_write(this->csn_pin, GPIO_PIN_HIGH);
-  return status;
+  return rf24_command(this, NOP, NULL, NULL, 0);
 }
 
 void rf24_enable_ack_payload(rf24_t * this)
 {
-  uint8_t ack_payloads = rf24_read_register(this, FEATURE) | _BV(EN_ACK_PAY) | _BV(EN_DPL);
+  uint8_t ack_payloads = rf24_cached_register(this, FEATURE) | _BV(EN_ACK_PAY) | _BV(EN_DPL);
 
   rf24_write_register(this, FEATURE, ack_payloads);
   if (!rf24_read_register(this, FEATURE)) {
@@ -500,15 +1989,17 @@ void rf24_enable_ack_payload(rf24_t * this)
    * enable dynamic payload length on pipe 0.
    * FIXME: find out why it is enabled on pipe 1 as well in the original lib
    */
-  rf24_write_register(this, DYNPD, rf24_read_register(this, DYNPD) | _BV(DPL_P0));
+  rf24_write_register(this, DYNPD, rf24_cached_register(this, DYNPD) | _BV(DPL_P0));
 
   this->ack_payload_enabled = 1;
   this->dynamic_payloads_enabled |= _BV(DPL_P0);
+
+  rf24_check_retry_delay(this);
 }
 
 void rf24_enable_dynamic_payloads(rf24_t * this)
 {
-  uint8_t dynamic_payloads = rf24_read_register(this, FEATURE) | _BV(EN_DPL);
+  uint8_t dynamic_payloads = rf24_cached_register(this, FEATURE) | _BV(EN_DPL);
   uint8_t dynamic_payloads_pipes = _BV(DPL_P5) | _BV(DPL_P4) | _BV(DPL_P3) | _BV(DPL_P2) | _BV(DPL_P1) | _BV(DPL_P0);
 
   /* enable the feature */
@@ -520,48 +2011,53 @@ void rf24_enable_dynamic_payloads(rf24_t * this)
   }
 
   /* set dynamic payloads for all pipes */
-  rf24_write_register(this, DYNPD, rf24_read_register(this, DYNPD) | dynamic_payloads_pipes);
+  rf24_write_register(this, DYNPD, rf24_cached_register(this, DYNPD) | dynamic_payloads_pipes);
 
   this->dynamic_payloads_enabled = dynamic_payloads_pipes;
 }
 
+/* Lets payloads be sent with W_TX_PAYLOAD_NOACK, the receiver does not ack them */
+void rf24_enable_dynamic_ack(rf24_t * this)
+{
+  uint8_t dynamic_ack = rf24_cached_register(this, FEATURE) | _BV(EN_DYN_ACK);
+
+  rf24_write_register(this, FEATURE, dynamic_ack);
+  if (!rf24_read_register(this, FEATURE)) {
+    rf24_enable_features(this);
+    rf24_write_register(this, FEATURE, dynamic_ack);
+  }
+}
+
 static void rf24_enable_features(rf24_t * this)
 {
-  gpio_write(this->csn_pin, GPIO_PIN_LOW);
-  spi_transfer(this->spi, ACTIVATE);
-  spi_transfer(this->spi, 0x73);
-  gpio_write(this->csn_pin, GPIO_PIN_HIGH);
+  uint8_t key = 0x73;
+  rf24_command(this, ACTIVATE, &key, NULL, 1);
 }
 
 static uint8_t rf24_flush_rx(rf24_t * this)
 {
-  uint8_t status;
-  gpio_write(this->csn_pin, GPIO_PIN_LOW);
-  status = spi_transfer(this->spi, FLUSH_RX);
-  gpio_write(this->csn_pin, GPIO_PIN_HIGH);
-  return status;
+  return rf24_command(this, FLUSH_RX, NULL, NULL, 0);
 }
 
 
 static uint8_t rf24_flush_tx(rf24_t * this)
 {
-  uint8_t status;
-  gpio_write(this->csn_pin, GPIO_PIN_LOW);
-  status = spi_transfer(this->spi, FLUSH_TX);
-  gpio_write(this->csn_pin, GPIO_PIN_HIGH);
-  return status;
+  uint8_t pipe;
+
+  for (pipe = 0; pipe < 6; pipe++) { this->ack_queues[pipe].in_chip = 0; }
+  return rf24_command(this, FLUSH_TX, NULL, NULL, 0);
 }
 
 void rf24_disable_crc(rf24_t * this)
 {
-  rf24_write_register(this, CONFIG, rf24_read_register(this, CONFIG) & ~_BV(EN_CRC) );
+  rf24_write_register(this, CONFIG, rf24_cached_register(this, CONFIG) & ~_BV(EN_CRC) );
 }
 
 void rf24_set_crc_length(rf24_t * this, uint8_t crc_length)
 {
   assert(crc_length == RF24_CRC_DISABLED || crc_length == RF24_CRC_8 || crc_length == RF24_CRC_16);
 
-  uint8_t config = rf24_read_register(this, CONFIG) & ~( _BV(CRCO) | _BV(EN_CRC) );
+  uint8_t config = rf24_cached_register(this, CONFIG) & ~( _BV(CRCO) | _BV(EN_CRC) );
   switch (crc_length) {
     case RF24_CRC_DISABLED:
       /* NOOP */
@@ -596,7 +2092,7 @@ void rf24_set_pa_level(rf24_t * this, uint8_t pa_level)
 {
   assert(pa_level == RF24_PA_MIN || pa_level == RF24_PA_LOW || pa_level == RF24_PA_HIGH || pa_level == RF24_PA_MAX);
 
-  uint8_t setup = rf24_read_register(this, RF_SETUP) & ~(_BV(RF_PWR_LOW) | _BV(RF_PWR_HIGH));
+  uint8_t setup = rf24_cached_register(this, RF_SETUP) & ~(_BV(RF_PWR_LOW) | _BV(RF_PWR_HIGH));
   switch(pa_level) {
     case RF24_PA_MAX:
       setup |= (_BV(RF_PWR_LOW) | _BV(RF_PWR_HIGH));
@@ -616,7 +2112,13 @@ void rf24_set_pa_level(rf24_t * this, uint8_t pa_level)
 void rf24_set_retries(rf24_t * this, uint8_t delay, uint8_t count)
 {
   assert(delay >= 0 && delay <= 15 && count >= 0 && count <= 15);
-  rf24_write_register(this, SETUP_RETR, (delay & 0xF << ARD) | (count & 0xf) << ARC);
+  rf24_write_register(this, SETUP_RETR, ((delay & 0xF) << ARD) | ((count & 0xF) << ARC));
+  rf24_check_retry_delay(this);
+}
+
+void rf24_set_tx_resend(rf24_t * this, uint8_t count)
+{
+  this->tx_resend = count;
 }
 
 void rf24_set_autoack(rf24_t * this, uint8_t autoack)
@@ -632,7 +2134,7 @@ void rf24_set_autoack_for_pipe(rf24_t * this, uint8_t pipe, uint8_t autoack)
 {
   assert(pipe >= 0 && pipe <= 5);
 
-  uint8_t autoack_enable = rf24_read_register(this, EN_AA);
+  uint8_t autoack_enable = rf24_cached_register(this, EN_AA);
   if (autoack) {
     rf24_write_register(this, EN_AA, autoack_enable | _BV(pipe));
   } else {
@@ -642,13 +2144,13 @@ void rf24_set_autoack_for_pipe(rf24_t * this, uint8_t pipe, uint8_t autoack)
 
 void rf24_power_up(rf24_t * this)
 {
-  rf24_write_register(this, CONFIG, rf24_read_register(this, CONFIG) | _BV(PWR_UP));
+  rf24_write_register(this, CONFIG, rf24_cached_register(this, CONFIG) | _BV(PWR_UP));
   usleep(150);
 }
 
 void rf24_power_down(rf24_t * this)
 {
-  rf24_write_register(this, CONFIG, rf24_read_register(this, CONFIG) & ~_BV(PWR_UP));
+  rf24_write_register(this, CONFIG, rf24_cached_register(this, CONFIG) & ~_BV(PWR_UP));
   usleep(150);
 }
 
@@ -661,7 +2163,7 @@ void rf24_set_data_rate(rf24_t * this, uint8_t speed)
 {
   assert(speed == RF24_250KBPS || speed == RF24_1MBPS || speed == RF24_2MBPS);
 
-  uint8_t setup = rf24_read_register(this, RF_SETUP) & ~(_BV(RF_DR_LOW) | _BV(RF_DR_HIGH));
+  uint8_t setup = rf24_cached_register(this, RF_SETUP) & ~(_BV(RF_DR_LOW) | _BV(RF_DR_HIGH));
   switch (speed) {
     case RF24_250KBPS:
       setup |= _BV(RF_DR_LOW);
@@ -675,6 +2177,7 @@ void rf24_set_data_rate(rf24_t * this, uint8_t speed)
   }
 
   rf24_write_register(this, RF_SETUP, setup);
+  rf24_check_retry_delay(this);
 }
 
 static uint8_t rf24_get_data_rate(rf24_t * this)
@@ -0,0 +1,234 @@
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "rf24_bulk.h"
+
+int8_t rf24_bulk_tx_init(rf24_bulk_tx_t * tx, rf24_t * radio, uint8_t window)
+{
+  memset(tx, 0, sizeof(rf24_bulk_tx_t));
+
+  if (window == 0 || window > RF24_BULK_MAX_WINDOW) {
+    fprintf(stderr, "[rf24_bulk] Window of %d frames out of range.\n", window);
+    return -1;
+  }
+  if (!radio->ack_payload_enabled || !radio->dynamic_payloads_enabled) {
+    fprintf(stderr, "[rf24_bulk] Bulk transfers need dynamic payloads and ack payloads.\n");
+    return -1;
+  }
+
+  tx->radio  = radio;
+  tx->window = window;
+  rf24_enable_dynamic_ack(radio);
+
+  return 0;
+}
+
+/* Looks through the ack payloads that came back for the receiver's answer */
+static int8_t rf24_bulk_read_ack(rf24_bulk_tx_t * tx, uint16_t * next, uint32_t * got, uint16_t * seen)
+{
+  rf24_frame_t frames[RF24_RX_FIFO_DEPTH];
+  const uint8_t * ack;
+  int8_t count, i, found = -1;
+
+  count = rf24_receive_all(tx->radio, frames, RF24_RX_FIFO_DEPTH);
+  for (i = 0; i < count; i++) {
+    ack = frames[i].data;
+    if (frames[i].len < RF24_BULK_ACK_LEN || ack[0] != (RF24_BULK_ACK | tx->id)) { continue; }
+
+    *next = ack[1] | (ack[2] << 8);
+    *got  = ack[3] | (ack[4] << 8) | (ack[5] << 16) | ((uint32_t) ack[6] << 24);
+    *seen = ack[7] | (ack[8] << 8);
+    found = 0;
+  }
+
+  return found;
+}
+
+/* The ack payload to a poll is the receiver's answer as of the last batch it
+ * drained, it may not have read the newest frames yet. Those past seen are
+ * not known to be missing, they are left alone until a later answer.
+ */
+static int8_t rf24_bulk_poll(rf24_bulk_tx_t * tx, uint16_t total, uint16_t * next, uint32_t * got, uint16_t * seen)
+{
+  uint8_t frame[RF24_BULK_POLL_LEN] = { RF24_BULK_POLL | tx->id, total & 0xFF, total >> 8 };
+  uint8_t tries, tx_ok;
+  int8_t ret;
+
+  for (tries = 0; tries < RF24_BULK_RETRIES; tries++) {
+    tx->stats.polls++;
+    tx_ok = rf24_send(tx->radio, frame, sizeof(frame));
+    ret   = tx_ok ? rf24_bulk_read_ack(tx, next, got, seen) : -1;
+    rf24_reset_status(tx->radio);
+
+    if (ret == 0) { return 0; }
+    usleep(RF24_BULK_POLL_DELAY_US);
+  }
+
+  return -1;
+}
+
+int8_t rf24_bulk_send(rf24_bulk_tx_t * tx, const void * buf, uint32_t len)
+{
+  const uint8_t * data = (const uint8_t *) buf;
+  uint8_t frame[RF24_MAX_PAYLOAD];
+  uint32_t total = len / RF24_BULK_CHUNK + (len % RF24_BULK_CHUNK || len == 0 ? 1 : 0);
+  uint32_t got = 0, got_now, offset;
+  uint16_t base = 0, seen = 0, next, seen_now, end, sent = 0, known, seq;
+  uint8_t stalls = 0, lost = 0, queued, size;
+
+  if (total > RF24_BULK_MAX_FRAMES) {
+    fprintf(stderr, "[rf24_bulk] Transfer of %d bytes needs too many frames.\n", len);
+    return -1;
+  }
+
+  tx->id = (tx->id + 1) & 0x0F;
+
+  while (base < total) {
+    end    = base + tx->window < total ? base + tx->window : total;
+    queued = 0;
+
+    /* frames sent but past what the receiver saw are still on their way,
+     * unless a poll after a round that sent nothing showed no progress
+     */
+    known = lost ? sent : seen;
+
+    for (seq = base; seq < end; seq++) {
+      if (seq < sent && (seq >= known || (got & (1U << (seq - base))))) { continue; }
+
+      offset = (uint32_t) seq * RF24_BULK_CHUNK;
+      size   = len - offset < RF24_BULK_CHUNK ? len - offset : RF24_BULK_CHUNK;
+
+      frame[0] = RF24_BULK_DATA | tx->id;
+      frame[1] = seq & 0xFF;
+      frame[2] = seq >> 8;
+      memcpy(frame + RF24_BULK_HEADER, data + offset, size);
+
+      /* TX FIFO full, wait for the chip to make room */
+      while (rf24_stream_write_noack(tx->radio, frame, RF24_BULK_HEADER + size, NULL, NULL) == -1) {
+        if (rf24_irq_wait(tx->radio, tx->radio->tx_timeout) == 0) { break; }
+        rf24_handle_tx_irq(tx->radio);
+      }
+
+      tx->stats.frames++;
+      if (seq < sent) { tx->stats.retransmits++; }
+      queued++;
+    }
+    if (end > sent) { sent = end; }
+
+    if (queued) {
+      rf24_stream_end(tx->radio, tx->radio->tx_timeout);
+      tx->stats.windows++;
+    }
+
+    if (rf24_bulk_poll(tx, total, &next, &got_now, &seen_now) == -1) {
+      fprintf(stderr, "[rf24_bulk] Receiver does not answer polls.\n");
+      return -1;
+    }
+
+    /* answers never go back, one that does is left over from before */
+    if (next < base || seen_now < seen) { next = base; got_now = got; seen_now = seen; }
+
+    lost   = !queued && next == base && seen_now == seen && got_now == got;
+    stalls = next > base ? 0 : stalls + 1;
+    if (stalls == RF24_BULK_RETRIES) {
+      fprintf(stderr, "[rf24_bulk] Transfer stuck at frame %d.\n", base);
+      return -1;
+    }
+
+    base = next;
+    got  = got_now;
+    seen = seen_now;
+  }
+
+  return 0;
+}
+
+void rf24_bulk_rx_init(rf24_bulk_rx_t * rx, void * buf, uint32_t max_len)
+{
+  memset(rx, 0, sizeof(rf24_bulk_rx_t));
+  rx->buf     = (uint8_t *) buf;
+  rx->max_len = max_len;
+}
+
+static void rf24_bulk_rx_data(rf24_bulk_rx_t * rx, uint16_t seq, const uint8_t * data, uint8_t size)
+{
+  uint32_t offset = (uint32_t) seq * RF24_BULK_CHUNK;
+  uint16_t ahead  = seq - rx->next;
+
+  /* below next it is in already, past the bitmap it can not be from the current window */
+  if (seq < rx->next || ahead >= RF24_BULK_MAX_WINDOW || (rx->got & (1U << ahead))) {
+    rx->duplicates++;
+    return;
+  }
+  if (offset + size > rx->max_len) { return; }
+
+  memcpy(rx->buf + offset, data, size);
+  if (offset + size > rx->len) { rx->len = offset + size; }
+  rx->frames++;
+
+  rx->got |= 1U << ahead;
+  while (rx->got & 1) {
+    rx->got >>= 1;
+    rx->next++;
+  }
+}
+
+/* Returns 1 when the frame completed the transfer, 0 when it was taken, -1
+ * when it is no bulk frame.
+ */
+int8_t rf24_bulk_rx_input(rf24_bulk_rx_t * rx, uint8_t pipe, const uint8_t * data, uint8_t len)
+{
+  uint8_t type = data[0] & 0xF0, id = data[0] & 0x0F;
+  uint16_t number;
+
+  if (len < RF24_BULK_HEADER || (type != RF24_BULK_DATA && type != RF24_BULK_POLL)) { return -1; }
+
+  /* a new transfer starts over */
+  if (!rx->active || id != rx->id) {
+    rf24_bulk_rx_init(rx, rx->buf, rx->max_len);
+    rx->active = 1;
+    rx->id     = id;
+  }
+  rx->pipe        = pipe;
+  rx->ack_pending = 1;
+
+  number = data[1] | (data[2] << 8);
+  if (type == RF24_BULK_DATA) {
+    rf24_bulk_rx_data(rx, number, data + RF24_BULK_HEADER, len - RF24_BULK_HEADER);
+    if (number >= rx->seen) { rx->seen = number + 1; }
+  } else {
+    rx->total = number;
+  }
+
+  if (!rx->complete && rx->total > 0 && rx->next >= rx->total) {
+    rx->complete = 1;
+    return 1;
+  }
+
+  return 0;
+}
+
+/* Replaces the ack payload with where the transfer stands, if a frame came
+ * in since the last time. Called once per batch of frames read, a POLL took
+ * the old one along with its ack.
+ */
+void rf24_bulk_rx_ack(rf24_bulk_rx_t * rx, rf24_t * radio)
+{
+  uint8_t ack[RF24_BULK_ACK_LEN];
+
+  if (!rx->ack_pending) { return; }
+  rx->ack_pending = 0;
+
+  ack[0] = RF24_BULK_ACK | rx->id;
+  ack[1] = rx->next & 0xFF;
+  ack[2] = rx->next >> 8;
+  ack[3] = rx->got & 0xFF;
+  ack[4] = (rx->got >> 8) & 0xFF;
+  ack[5] = (rx->got >> 16) & 0xFF;
+  ack[6] = rx->got >> 24;
+  ack[7] = rx->seen & 0xFF;
+  ack[8] = rx->seen >> 8;
+  rf24_replace_ack_payload(radio, rx->pipe, ack, sizeof(ack));
+}
+// vim:ai:cin:et:sts=2 sw=2 ft=c
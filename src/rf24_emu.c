@@ -0,0 +1,576 @@
+#include <assert.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <poll.h>
+
+#include "rf24_emu.h"
+#include "nRF24L01.h"
+
+#define _BV(x) (1 << (x))
+
+/* largest chip select frame: command byte plus a full payload */
+#define RF24_EMU_FRAME_SIZE (RF24_MAX_PAYLOAD + 1)
+
+#define RF24_EMU_IRQ_BITS (_BV(RX_DR) | _BV(TX_DS) | _BV(MAX_RT))
+
+static int8_t rf24_emu_transfer(void * ctx, spi_msg_t * msg, uint8_t first, uint8_t count);
+static void rf24_emu_ce(void * ctx, uint8_t level);
+static int8_t rf24_emu_irq_wait(void * ctx, int32_t timeout_ms, uint64_t * timestamp_ns);
+static int32_t rf24_emu_irq_fd(void * ctx, uint32_t * events);
+
+const rf24_transport_t rf24_emu_transport = {
+  .transfer = rf24_emu_transfer,
+  .csn      = NULL,
+  .ce       = rf24_emu_ce,
+  .irq_wait = rf24_emu_irq_wait,
+  .irq_fd   = rf24_emu_irq_fd,
+};
+
+static uint8_t rf24_emu_lost(rf24_emu_air_t * air)
+{
+  if (air->loss == 0) { return 0; }
+
+  air->seed = air->seed * 1103515245 + 12345;
+  return ((air->seed >> 16) % 1000) < air->loss;
+}
+
+static uint8_t rf24_emu_status(rf24_emu_t * emu)
+{
+  uint8_t status = emu->irq;
+
+  status |= (emu->rx_count ? emu->rx_fifo[0].pipe : 0b111) << RX_P_NO;
+  if (emu->tx_count == RF24_EMU_FIFO_DEPTH) { status |= _BV(TX_FULL); }
+
+  return status;
+}
+
+static uint8_t rf24_emu_fifo_status(rf24_emu_t * emu)
+{
+  uint8_t fifo = 0;
+
+  if (emu->reuse)                             { fifo |= _BV(TX_REUSE); }
+  if (emu->tx_count == RF24_EMU_FIFO_DEPTH)   { fifo |= _BV(FIFO_FULL); }
+  if (emu->tx_count == 0)                     { fifo |= _BV(TX_EMPTY); }
+  if (emu->rx_count == RF24_EMU_FIFO_DEPTH)   { fifo |= _BV(RX_FULL); }
+  if (emu->rx_count == 0)                     { fifo |= _BV(RX_EMPTY); }
+
+  return fifo;
+}
+
+uint8_t rf24_emu_irq(rf24_emu_t * emu)
+{
+  /* the CONFIG mask bits sit at the same positions as their STATUS flags */
+  return (emu->irq & ~emu->regs[CONFIG] & RF24_EMU_IRQ_BITS) != 0;
+}
+
+static void rf24_emu_raise(rf24_emu_t * emu, uint8_t bits)
+{
+  struct timespec ts;
+  uint8_t asserted = rf24_emu_irq(emu);
+
+  emu->irq |= bits;
+  if (rf24_emu_irq(emu) && !asserted) {
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    emu->irq_ns = (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+    pthread_cond_broadcast(&emu->air->irq);
+    if (emu->event_fd != -1) {
+      eventfd_write(emu->event_fd, 1);
+    }
+  }
+}
+
+static uint8_t rf24_emu_addr_width(rf24_emu_t * emu)
+{
+  uint8_t aw = emu->regs[SETUP_AW] & 0b11;
+  return aw == 0 ? 3 : aw + 2;
+}
+
+static uint8_t rf24_emu_dynamic(rf24_emu_t * emu, uint8_t pipe)
+{
+  return (emu->regs[FEATURE] & _BV(EN_DPL)) && (emu->regs[DYNPD] & _BV(pipe));
+}
+
+/* CRC-16-CCITT of the payload, what the chip compares along with the PID */
+static uint16_t rf24_emu_checksum(const struct rf24_emu_payload * p)
+{
+  uint16_t crc = 0xFFFF;
+  uint8_t i, bit;
+
+  for (i = 0; i < p->len; i++) {
+    crc ^= (uint16_t) p->data[i] << 8;
+    for (bit = 0; bit < 8; bit++) {
+      crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : crc << 1;
+    }
+  }
+  return crc;
+}
+
+/* pipe of rx listening on the address of tx, -1 when it does not */
+static int8_t rf24_emu_match(rf24_emu_t * rx, rf24_emu_t * tx)
+{
+  uint8_t aw = rf24_emu_addr_width(rx);
+  uint8_t pipe;
+
+  if (aw != rf24_emu_addr_width(tx)) { return -1; }
+
+  for (pipe = 0; pipe < 6; pipe++) {
+    if (!(rx->regs[EN_RXADDR] & _BV(pipe))) { continue; }
+
+    if (pipe < 2) {
+      if (memcmp(rx->rx_addr[pipe], tx->tx_addr, aw) == 0) { return pipe; }
+    } else {
+      /* pipes 2-5 only own the first byte, the rest is shared with pipe 1 */
+      if (rx->regs[RX_ADDR_P0 + pipe] == tx->tx_addr[0] && memcmp(rx->rx_addr[1] + 1, tx->tx_addr + 1, aw - 1) == 0) {
+        return pipe;
+      }
+    }
+  }
+
+  return -1;
+}
+
+static uint8_t rf24_emu_listening(rf24_emu_t * emu)
+{
+  return emu->ce && (emu->regs[CONFIG] & _BV(PWR_UP)) && (emu->regs[CONFIG] & _BV(PRIM_RX));
+}
+
+static void rf24_emu_pop(struct rf24_emu_payload * fifo, uint8_t * count, uint8_t pos)
+{
+  memmove(&fifo[pos], &fifo[pos + 1], (*count - pos - 1) * sizeof(struct rf24_emu_payload));
+  (*count)--;
+}
+
+/* Puts p from tx on the air once. Returns 1 when tx got an ack back. */
+static uint8_t rf24_emu_deliver(rf24_emu_t * tx, struct rf24_emu_payload * p)
+{
+  rf24_emu_air_t * air = tx->air;
+  struct rf24_emu_payload * ack;
+  rf24_emu_t * rx = NULL;
+  int8_t pipe = -1;
+  uint16_t sum;
+  uint8_t i, rate_mask = _BV(RF_DR_LOW) | _BV(RF_DR_HIGH);
+
+  for (i = 0; i < air->count && pipe == -1; i++) {
+    rx = air->radios[i];
+    if (rx == tx || !rf24_emu_listening(rx)) { continue; }
+    if (rx->regs[RF_CH] != tx->regs[RF_CH]) { continue; }
+    if ((rx->regs[RF_SETUP] & rate_mask) != (tx->regs[RF_SETUP] & rate_mask)) { continue; }
+    pipe = rf24_emu_match(rx, tx);
+  }
+
+  if (pipe == -1 || rf24_emu_lost(air)) { return 0; }
+
+  /* both ends have to agree on the packet control field */
+  if (rf24_emu_dynamic(rx, pipe) != rf24_emu_dynamic(tx, 0)) { return 0; }
+  if (!rf24_emu_dynamic(rx, pipe) && p->len != rx->regs[RX_PW_P0 + pipe]) { return 0; }
+
+  sum = rf24_emu_checksum(p);
+  if (!p->noack && rx->last_pid[pipe] == p->pid && rx->last_sum[pipe] == sum) {
+    /* retransmit of a frame we already have, ack it again */
+  } else if (rx->rx_count == RF24_EMU_FIFO_DEPTH) {
+    /* a full RX FIFO drops the frame without acking it */
+    rx->stats.rx_dropped++;
+    return 0;
+  } else {
+    rx->rx_fifo[rx->rx_count] = *p;
+    rx->rx_fifo[rx->rx_count].pipe = pipe;
+    rx->rx_count++;
+    rx->last_pid[pipe] = p->pid;
+    rx->last_sum[pipe] = sum;
+    rx->stats.rx_packets++;
+    rf24_emu_raise(rx, _BV(RX_DR));
+  }
+
+  if (p->noack || !(rx->regs[EN_AA] & _BV(pipe))) { return 0; }
+  if (rf24_emu_lost(air)) { return 0; }
+
+  /* the ack carries the oldest ack payload queued for this pipe */
+  if (rx->regs[FEATURE] & _BV(EN_ACK_PAY)) {
+    for (i = 0; i < rx->tx_count; i++) {
+      ack = &rx->tx_fifo[i];
+      if (!ack->ack || ack->pipe != pipe) { continue; }
+
+      if (tx->rx_count < RF24_EMU_FIFO_DEPTH) {
+        tx->rx_fifo[tx->rx_count] = *ack;
+        tx->rx_fifo[tx->rx_count].pipe = 0;
+        tx->rx_count++;
+        rf24_emu_raise(tx, _BV(RX_DR));
+      }
+      rf24_emu_pop(rx->tx_fifo, &rx->tx_count, i);
+      rf24_emu_raise(rx, _BV(TX_DS));
+      break;
+    }
+  }
+
+  return 1;
+}
+
+/* Sends up to max payloads from the TX FIFO, as far as CE and mode allow. */
+static void rf24_emu_transmit(rf24_emu_t * emu, uint8_t max)
+{
+  struct rf24_emu_payload * p;
+  uint8_t attempt, retries, acked, expect_ack, plos;
+
+  while (max-- && emu->ce && emu->tx_count > 0 && !(emu->irq & _BV(MAX_RT))) {
+    if (!(emu->regs[CONFIG] & _BV(PWR_UP)) || (emu->regs[CONFIG] & _BV(PRIM_RX))) { return; }
+
+    p = &emu->tx_fifo[0];
+    /* the PTX expects its ack on pipe 0 */
+    expect_ack = !p->noack && (emu->regs[EN_AA] & _BV(ENAA_P0));
+    retries    = expect_ack ? emu->regs[SETUP_RETR] & 0xF : 0;
+    acked      = 0;
+
+    for (attempt = 0; attempt <= retries; attempt++) {
+      emu->stats.tx_packets++;
+      acked = rf24_emu_deliver(emu, p);
+      if (acked || !expect_ack) { break; }
+    }
+
+    if (attempt > retries) { attempt = retries; }
+    emu->stats.tx_retries += attempt;
+    plos = emu->regs[OBSERVE_TX] >> PLOS_CNT;
+
+    if (acked || !expect_ack) {
+      emu->regs[OBSERVE_TX] = (plos << PLOS_CNT) | attempt;
+      if (!emu->reuse) {
+        rf24_emu_pop(emu->tx_fifo, &emu->tx_count, 0);
+      }
+      rf24_emu_raise(emu, _BV(TX_DS));
+    } else {
+      if (plos < 15) { plos++; }
+      emu->regs[OBSERVE_TX] = (plos << PLOS_CNT) | attempt;
+      emu->stats.tx_failed++;
+      rf24_emu_raise(emu, _BV(MAX_RT));
+    }
+  }
+}
+
+static void rf24_emu_push_tx(rf24_emu_t * emu, const uint8_t * data, uint8_t len, uint8_t pipe, uint8_t ack, uint8_t noack)
+{
+  struct rf24_emu_payload * p;
+
+  if (emu->tx_count == RF24_EMU_FIFO_DEPTH || len == 0) { return; }
+
+  p = &emu->tx_fifo[emu->tx_count++];
+  memset(p, 0, sizeof(struct rf24_emu_payload));
+  memcpy(p->data, data, len > RF24_MAX_PAYLOAD ? RF24_MAX_PAYLOAD : len);
+  p->len   = len > RF24_MAX_PAYLOAD ? RF24_MAX_PAYLOAD : len;
+  p->pipe  = pipe;
+  p->ack   = ack;
+  p->noack = noack;
+  /* two bit packet id, new for every payload */
+  p->pid   = emu->pid = (emu->pid + 1) & 0b11;
+  emu->reuse = 0;
+}
+
+static void rf24_emu_read_register(rf24_emu_t * emu, uint8_t reg, uint8_t * data, uint8_t len)
+{
+  uint8_t i;
+
+  switch (reg) {
+    case RX_ADDR_P0:
+    case RX_ADDR_P1:
+      memcpy(data, emu->rx_addr[reg - RX_ADDR_P0], len < RF24_EMU_ADDR_WIDTH ? len : RF24_EMU_ADDR_WIDTH);
+      return;
+    case TX_ADDR:
+      memcpy(data, emu->tx_addr, len < RF24_EMU_ADDR_WIDTH ? len : RF24_EMU_ADDR_WIDTH);
+      return;
+  }
+
+  for (i = 0; i < len; i++) {
+    switch (reg) {
+      case STATUS:      data[i] = rf24_emu_status(emu);      break;
+      case FIFO_STATUS: data[i] = rf24_emu_fifo_status(emu); break;
+      case RPD:         data[i] = 0;                         break;
+      default:          data[i] = reg < RF24_REGISTER_COUNT ? emu->regs[reg] : 0; break;
+    }
+  }
+}
+
+static void rf24_emu_write_register(rf24_emu_t * emu, uint8_t reg, const uint8_t * data, uint8_t len)
+{
+  if (len == 0) { return; }
+
+  switch (reg) {
+    case RX_ADDR_P0:
+    case RX_ADDR_P1:
+      memcpy(emu->rx_addr[reg - RX_ADDR_P0], data, len < RF24_EMU_ADDR_WIDTH ? len : RF24_EMU_ADDR_WIDTH);
+      break;
+    case TX_ADDR:
+      memcpy(emu->tx_addr, data, len < RF24_EMU_ADDR_WIDTH ? len : RF24_EMU_ADDR_WIDTH);
+      break;
+    case STATUS:
+      /* interrupt flags are cleared by writing 1 to them */
+      emu->irq &= ~(data[0] & RF24_EMU_IRQ_BITS);
+      break;
+    case RF_CH:
+      emu->regs[reg] = data[0] & 0x7F;
+      /* writing RF_CH resets the lost packet counter */
+      emu->regs[OBSERVE_TX] &= 0x0F;
+      break;
+    case CONFIG:
+      emu->regs[reg] = data[0] & 0x7F;
+      break;
+    case OBSERVE_TX:
+    case FIFO_STATUS:
+    case RPD:
+      /* read only */
+      break;
+    default:
+      if (reg < RF24_REGISTER_COUNT) {
+        emu->regs[reg] = data[0];
+      }
+      break;
+  }
+}
+
+/* Runs one chip select frame in place: buf holds what goes out on MOSI and gets what comes back on MISO. */
+static void rf24_emu_command(rf24_emu_t * emu, uint8_t * buf, uint8_t len)
+{
+  struct rf24_emu_payload * p;
+  uint8_t cmd = buf[0], status, n;
+  uint8_t * data = buf + 1;
+  uint8_t in[RF24_EMU_FRAME_SIZE];
+
+  if (len == 0) { return; }
+
+  n = len - 1;
+  memcpy(in, data, n);
+  status = rf24_emu_status(emu);
+  memset(data, 0, n);
+  buf[0] = status;
+
+  if ((cmd & 0xE0) == R_REGISTER) {
+    rf24_emu_read_register(emu, cmd & REGISTER_MASK, data, n);
+  } else if ((cmd & 0xE0) == W_REGISTER) {
+    rf24_emu_write_register(emu, cmd & REGISTER_MASK, in, n);
+  } else if ((cmd & 0xF8) == W_ACK_PAYLOAD) {
+    if (emu->regs[FEATURE] & _BV(EN_ACK_PAY)) {
+      rf24_emu_push_tx(emu, in, n, cmd & 0b111, 1, 0);
+    }
+  } else {
+    switch (cmd) {
+      case R_RX_PL_WID:
+        if (n > 0) { data[0] = emu->rx_count ? emu->rx_fifo[0].len : 0; }
+        break;
+      case R_RX_PAYLOAD:
+        if (emu->rx_count) {
+          p = &emu->rx_fifo[0];
+          memcpy(data, p->data, n < p->len ? n : p->len);
+          rf24_emu_pop(emu->rx_fifo, &emu->rx_count, 0);
+        }
+        break;
+      case W_TX_PAYLOAD:
+        rf24_emu_push_tx(emu, in, n, 0, 0, 0);
+        break;
+      case W_TX_PAYLOAD_NOACK:
+        if (emu->regs[FEATURE] & _BV(EN_DYN_ACK)) {
+          rf24_emu_push_tx(emu, in, n, 0, 0, 1);
+        }
+        break;
+      case FLUSH_TX:
+        emu->tx_count = 0;
+        emu->reuse = 0;
+        break;
+      case FLUSH_RX:
+        emu->rx_count = 0;
+        break;
+      case REUSE_TX_PL:
+        emu->reuse = 1;
+        break;
+      case ACTIVATE:
+      case NOP:
+      default:
+        break;
+    }
+  }
+}
+
+static int8_t rf24_emu_transfer(void * ctx, spi_msg_t * msg, uint8_t first, uint8_t count)
+{
+  rf24_emu_t * emu = (rf24_emu_t *) ctx;
+  struct spi_ioc_transfer * xfer;
+  uint8_t frame[RF24_EMU_FRAME_SIZE];
+  uint32_t len, pos;
+  uint8_t i, start, end, n;
+
+  assert(first + count <= msg->count);
+
+  pthread_mutex_lock(&emu->air->lock);
+
+  /* a frame runs until a transfer with cs_change, or the end of the range */
+  for (start = first; start < first + count; start = end + 1) {
+    len = 0;
+    for (end = start; end < first + count; end++) {
+      xfer = &msg->xfer[end];
+      n = xfer->len < sizeof(frame) - len ? xfer->len : sizeof(frame) - len;
+      if (xfer->tx_buf) {
+        memcpy(frame + len, (const uint8_t *) (uintptr_t) xfer->tx_buf, n);
+      } else {
+        memset(frame + len, 0, n);
+      }
+      len += n;
+      if (xfer->cs_change || end == first + count - 1) { break; }
+    }
+
+    rf24_emu_command(emu, frame, len);
+
+    for (i = start, pos = 0; i <= end; i++) {
+      xfer = &msg->xfer[i];
+      n = xfer->len < len - pos ? xfer->len : len - pos;
+      if (xfer->rx_buf) {
+        memcpy((uint8_t *) (uintptr_t) xfer->rx_buf, frame + pos, n);
+      }
+      pos += n;
+    }
+
+    /* with CE held high the chip keeps sending whatever gets queued */
+    rf24_emu_transmit(emu, RF24_EMU_FIFO_DEPTH);
+  }
+
+  pthread_mutex_unlock(&emu->air->lock);
+
+  return 0;
+}
+
+static void rf24_emu_ce(void * ctx, uint8_t level)
+{
+  rf24_emu_t * emu = (rf24_emu_t *) ctx;
+
+  pthread_mutex_lock(&emu->air->lock);
+
+  /* a rising edge sends one payload even if CE drops right after, like a 10us pulse */
+  if (level && !emu->ce) {
+    emu->ce = 1;
+    rf24_emu_transmit(emu, 1);
+  } else {
+    emu->ce = level ? 1 : 0;
+  }
+
+  pthread_mutex_unlock(&emu->air->lock);
+}
+
+static int8_t rf24_emu_irq_wait(void * ctx, int32_t timeout_ms, uint64_t * timestamp_ns)
+{
+  rf24_emu_t * emu = (rf24_emu_t *) ctx;
+  struct timespec deadline;
+  uint8_t asserted;
+  int ret = 0;
+
+  pthread_mutex_lock(&emu->air->lock);
+
+  rf24_emu_transmit(emu, RF24_EMU_FIFO_DEPTH);
+
+  if (timeout_ms > 0) {
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec  += timeout_ms / 1000;
+    deadline.tv_nsec += (timeout_ms % 1000) * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L) {
+      deadline.tv_sec++;
+      deadline.tv_nsec -= 1000000000L;
+    }
+  }
+
+  while (!rf24_emu_irq(emu) && timeout_ms != 0 && ret != ETIMEDOUT) {
+    if (timeout_ms < 0) {
+      ret = pthread_cond_wait(&emu->air->irq, &emu->air->lock);
+    } else {
+      ret = pthread_cond_timedwait(&emu->air->irq, &emu->air->lock, &deadline);
+    }
+  }
+  asserted = rf24_emu_irq(emu);
+  if (asserted) {
+    *timestamp_ns = emu->irq_ns;
+  }
+  /* the event fd stands for an edge, like the GPIO backends' fds it is
+   * consumed by the wait and only becomes readable again on the next one
+   */
+  if (emu->event_fd != -1) {
+    eventfd_read(emu->event_fd, &(eventfd_t) { 0 });
+  }
+
+  pthread_mutex_unlock(&emu->air->lock);
+
+  return asserted;
+}
+
+static int32_t rf24_emu_irq_fd(void * ctx, uint32_t * events)
+{
+  rf24_emu_t * emu = (rf24_emu_t *) ctx;
+
+  *events = POLLIN;
+  return emu->event_fd;
+}
+
+void rf24_emu_air_init(rf24_emu_air_t * air, uint16_t loss)
+{
+  memset(air, 0, sizeof(rf24_emu_air_t));
+  air->loss = loss;
+  air->seed = 1;
+  pthread_mutex_init(&air->lock, NULL);
+  pthread_cond_init(&air->irq, NULL);
+}
+
+void rf24_emu_air_destroy(rf24_emu_air_t * air)
+{
+  pthread_cond_destroy(&air->irq);
+  pthread_mutex_destroy(&air->lock);
+}
+
+int8_t rf24_emu_init(rf24_emu_t * emu, rf24_emu_air_t * air)
+{
+  static const uint8_t reset_values[RF24_REGISTER_COUNT] = {
+    [CONFIG]     = 0x08, [EN_AA]      = 0x3F, [EN_RXADDR]  = 0x03, [SETUP_AW]   = 0x03,
+    [SETUP_RETR] = 0x03, [RF_CH]      = 0x02, [RF_SETUP]   = 0x0E,
+    [RX_ADDR_P2] = 0xC3, [RX_ADDR_P3] = 0xC4, [RX_ADDR_P4] = 0xC5, [RX_ADDR_P5] = 0xC6,
+  };
+
+  memset(emu, 0, sizeof(rf24_emu_t));
+  memcpy(emu->regs, reset_values, sizeof(reset_values));
+  memset(emu->rx_addr[0], 0xE7, RF24_EMU_ADDR_WIDTH);
+  memset(emu->rx_addr[1], 0xC2, RF24_EMU_ADDR_WIDTH);
+  memset(emu->tx_addr,    0xE7, RF24_EMU_ADDR_WIDTH);
+  memset(emu->last_pid,   0xFF, sizeof(emu->last_pid));
+
+  if ((emu->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1) {
+    fprintf(stderr, "[rf24_emu] Error creating IRQ event fd.\n");
+    return -1;
+  }
+
+  pthread_mutex_lock(&air->lock);
+  if (air->count == RF24_EMU_MAX_RADIOS) {
+    pthread_mutex_unlock(&air->lock);
+    fprintf(stderr, "[rf24_emu] Too many radios on the air.\n");
+    close(emu->event_fd);
+    emu->event_fd = -1;
+    return -1;
+  }
+  emu->air = air;
+  air->radios[air->count++] = emu;
+  pthread_mutex_unlock(&air->lock);
+
+  return 0;
+}
+
+void rf24_emu_destroy(rf24_emu_t * emu)
+{
+  rf24_emu_air_t * air = emu->air;
+  uint8_t i;
+
+  pthread_mutex_lock(&air->lock);
+  for (i = 0; i < air->count; i++) {
+    if (air->radios[i] == emu) {
+      air->radios[i] = air->radios[--air->count];
+      break;
+    }
+  }
+  pthread_mutex_unlock(&air->lock);
+
+  close(emu->event_fd);
+  emu->event_fd = -1;
+}
+// vim:ai:cin:et:sts=2 sw=2 ft=c
@@ -0,0 +1,276 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "rf24_frag.h"
+
+static uint16_t rf24_frag_chunk(rf24_frag_t * frag)
+{
+  return frag->fragment_size - RF24_FRAG_HEADER;
+}
+
+/* fragments a message of max_len bytes may take, the last one always has room for one byte less */
+static uint32_t rf24_frag_max_fragments(rf24_frag_t * frag)
+{
+  return frag->max_len / rf24_frag_chunk(frag) + 1;
+}
+
+int8_t rf24_frag_init(rf24_frag_t * frag, uint8_t slots, uint32_t max_len, uint8_t fragment_size, uint32_t timeout_ms, rf24_frag_callback_t callback, void * ctx)
+{
+  uint32_t words;
+  uint8_t i;
+
+  memset(frag, 0, sizeof(rf24_frag_t));
+  frag->slots         = slots;
+  frag->max_len       = max_len;
+  frag->fragment_size = fragment_size;
+  frag->timeout_ms    = timeout_ms;
+  frag->callback      = callback;
+  frag->ctx           = ctx;
+
+  /* the header and the last fragment's length byte have to leave room for data */
+  if (fragment_size < RF24_FRAG_HEADER + 2 || fragment_size > RF24_MAX_PAYLOAD) {
+    fprintf(stderr, "[rf24_frag] Fragment size %d out of range.\n", fragment_size);
+    return -1;
+  }
+  if (rf24_frag_max_fragments(frag) > RF24_FRAG_MAX_FRAGMENTS) {
+    fprintf(stderr, "[rf24_frag] %d slots of %d bytes can not be reassembled.\n", slots, max_len);
+    return -1;
+  }
+
+  /* a sender needs no slots */
+  if (slots == 0) { return 0; }
+
+  if ((frag->msgs = calloc(slots, sizeof(rf24_frag_msg_t))) == NULL) {
+    fprintf(stderr, "[rf24_frag] Error allocating %d slots.\n", slots);
+    return -1;
+  }
+
+  words = (rf24_frag_max_fragments(frag) + 31) / 32;
+  for (i = 0; i < slots; i++) {
+    frag->msgs[i].data = malloc(max_len);
+    frag->msgs[i].seen = calloc(words, sizeof(uint32_t));
+    if (frag->msgs[i].data == NULL || frag->msgs[i].seen == NULL) {
+      fprintf(stderr, "[rf24_frag] Error allocating slot of %d bytes.\n", max_len);
+      rf24_frag_free(frag);
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+void rf24_frag_free(rf24_frag_t * frag)
+{
+  uint8_t i;
+
+  if (frag->msgs == NULL) { return; }
+
+  for (i = 0; i < frag->slots; i++) {
+    free(frag->msgs[i].data);
+    free(frag->msgs[i].seen);
+  }
+  free(frag->msgs);
+  frag->msgs = NULL;
+}
+
+int8_t rf24_frag_send(rf24_frag_t * frag, rf24_t * radio, const void * buf, uint32_t len)
+{
+  const uint8_t * data = (const uint8_t *) buf;
+  uint16_t chunk = rf24_frag_chunk(frag), word;
+  uint32_t count = len / chunk + 1, i;
+  uint8_t header[RF24_FRAG_HEADER + 1];
+  struct iovec iov[2];
+  uint8_t id = frag->next_id++;
+
+  if (!radio->dynamic_payloads_enabled && frag->fragment_size > radio->payload_size) {
+    fprintf(stderr, "[rf24_frag] Fragments of %d bytes do not fit %d byte payloads.\n", frag->fragment_size, radio->payload_size);
+    return -1;
+  }
+  if (count > RF24_FRAG_MAX_FRAGMENTS) {
+    fprintf(stderr, "[rf24_frag] Message of %u bytes needs too many fragments.\n", len);
+    return -1;
+  }
+
+  /* header and data go out as two segments, the message is never copied */
+  for (i = 0; i < count; i++) {
+    word = i | (i == count - 1 ? RF24_FRAG_LAST : 0);
+    header[0] = id;
+    header[1] = word & 0xFF;
+    header[2] = word >> 8;
+
+    iov[0].iov_base = header;
+    iov[0].iov_len  = RF24_FRAG_HEADER;
+    iov[1].iov_base = (void *) (data + i * chunk);
+    iov[1].iov_len  = chunk;
+
+    if (i == count - 1) {
+      header[RF24_FRAG_HEADER] = len - i * chunk;
+      iov[0].iov_len = RF24_FRAG_HEADER + 1;
+      iov[1].iov_len = len - i * chunk;
+    }
+
+    if (!rf24_sendv(radio, iov, 2)) {
+      frag->stats.send_failed++;
+      return -1;
+    }
+  }
+
+  frag->stats.sent++;
+  return 0;
+}
+
+static void rf24_frag_release(rf24_frag_msg_t * msg, uint32_t words)
+{
+  msg->in_use = 0;
+  memset(msg->seen, 0, words * sizeof(uint32_t));
+}
+
+static rf24_frag_msg_t * rf24_frag_find(rf24_frag_t * frag, uint8_t pipe, uint8_t id)
+{
+  uint8_t i;
+
+  for (i = 0; i < frag->slots; i++) {
+    if (frag->msgs[i].in_use && frag->msgs[i].pipe == pipe && frag->msgs[i].id == id) { return &frag->msgs[i]; }
+  }
+  return NULL;
+}
+
+static rf24_frag_msg_t * rf24_frag_start(rf24_frag_t * frag, uint8_t pipe, uint8_t id)
+{
+  rf24_frag_msg_t * msg;
+  uint8_t i;
+
+  for (i = 0; i < frag->slots; i++) {
+    msg = &frag->msgs[i];
+    if (msg->in_use) { continue; }
+
+    msg->in_use     = 1;
+    msg->pipe       = pipe;
+    msg->id         = id;
+    msg->received   = 0;
+    msg->count      = 0;
+    msg->top        = 0;
+    msg->len        = 0;
+    msg->started_ns = rf24_now_ns();
+    return msg;
+  }
+  return NULL;
+}
+
+/* Returns 1 when the fragment completed its message, 0 when it was taken,
+ * -1 when it was dropped.
+ */
+int8_t rf24_frag_input(rf24_frag_t * frag, uint8_t pipe, const uint8_t * data, uint8_t len)
+{
+  rf24_frag_msg_t * msg;
+  uint16_t chunk = rf24_frag_chunk(frag), word, index, size;
+  uint32_t offset, words = (rf24_frag_max_fragments(frag) + 31) / 32;
+  uint8_t last;
+
+  if (len < RF24_FRAG_HEADER || pipe > 5) {
+    frag->stats.invalid++;
+    return -1;
+  }
+
+  word   = data[1] | (data[2] << 8);
+  index  = word & RF24_FRAG_INDEX_MASK;
+  last   = (word & RF24_FRAG_LAST) != 0;
+  offset = (uint32_t) index * chunk;
+
+  if (last) {
+    size = len > RF24_FRAG_HEADER ? data[RF24_FRAG_HEADER] : 0;
+    if (len == RF24_FRAG_HEADER || size >= chunk || len < RF24_FRAG_HEADER + 1 + size) { frag->stats.invalid++; return -1; }
+  } else {
+    size = chunk;
+    if (len < RF24_FRAG_HEADER + size) { frag->stats.invalid++; return -1; }
+  }
+  if (offset + size > frag->max_len) {
+    frag->stats.invalid++;
+    return -1;
+  }
+
+  if ((msg = rf24_frag_find(frag, pipe, data[0])) == NULL) {
+    /* a fragment of the message just completed, sent again because its ack got lost */
+    if (frag->last_valid[pipe] && frag->last_id[pipe] == data[0] &&
+        rf24_now_ns() - frag->last_ns[pipe] < frag->timeout_ms * 1000000ULL) {
+      frag->stats.duplicates++;
+      return -1;
+    }
+    if ((msg = rf24_frag_start(frag, pipe, data[0])) == NULL) {
+      frag->stats.no_slot++;
+      return -1;
+    }
+  }
+
+  if (msg->seen[index / 32] & (1U << (index % 32))) {
+    frag->stats.duplicates++;
+    return 0;
+  }
+  msg->seen[index / 32] |= 1U << (index % 32);
+  msg->received++;
+  msg->updated_ns = rf24_now_ns();
+  if (index >= msg->top) { msg->top = index + 1; }
+
+  memcpy(msg->data + offset, data + RF24_FRAG_HEADER + (last ? 1 : 0), size);
+  if (last) {
+    msg->count = index + 1;
+    msg->len   = offset + size;
+  }
+
+  if (msg->count == 0 || msg->received < msg->count) {
+    return 0;
+  }
+
+  frag->stats.completed++;
+  frag->last_id[pipe]    = msg->id;
+  frag->last_valid[pipe] = 1;
+  frag->last_ns[pipe]    = rf24_now_ns();
+
+  if (frag->callback != NULL) {
+    frag->callback(frag, RF24_FRAG_COMPLETE, msg, frag->ctx);
+  }
+  rf24_frag_release(msg, words);
+
+  return 1;
+}
+
+/* Gives up on the messages that got no fragment for timeout_ms, returns how many */
+uint8_t rf24_frag_expire(rf24_frag_t * frag)
+{
+  rf24_frag_msg_t * msg;
+  uint64_t now = rf24_now_ns();
+  uint32_t words = (rf24_frag_max_fragments(frag) + 31) / 32;
+  uint8_t i, expired = 0;
+
+  for (i = 0; i < frag->slots; i++) {
+    msg = &frag->msgs[i];
+    if (!msg->in_use || now - msg->updated_ns < frag->timeout_ms * 1000000ULL) { continue; }
+
+    frag->stats.timeouts++;
+    expired++;
+
+    if (frag->callback != NULL) {
+      frag->callback(frag, RF24_FRAG_TIMEOUT, msg, frag->ctx);
+    }
+    rf24_frag_release(msg, words);
+  }
+
+  return expired;
+}
+
+/* Indexes of the fragments still missing, up to max of them. Until the last
+ * fragment is in the count is not known: the gaps below the highest index
+ * seen are listed, whatever follows it is not.
+ */
+uint16_t rf24_frag_missing(const rf24_frag_msg_t * msg, uint16_t * missing, uint16_t max)
+{
+  uint16_t end = msg->count ? msg->count : msg->top, found = 0, i;
+
+  for (i = 0; i < end && found < max; i++) {
+    if (!(msg->seen[i / 32] & (1U << (i % 32)))) { missing[found++] = i; }
+  }
+
+  return found;
+}
+// vim:ai:cin:et:sts=2 sw=2 ft=c
@@ -0,0 +1,135 @@
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/epoll.h>
+
+#include "rf24_group.h"
+
+int8_t rf24_group_init(rf24_group_t * group)
+{
+  memset(group, 0, sizeof(rf24_group_t));
+
+  if ((group->epfd = epoll_create1(EPOLL_CLOEXEC)) == -1) {
+    fprintf(stderr, "[rf24_group] Error creating epoll set.\n");
+    return -1;
+  }
+
+  return 0;
+}
+
+void rf24_group_destroy(rf24_group_t * group)
+{
+  close(group->epfd);
+  group->epfd  = -1;
+  group->count = 0;
+}
+
+int8_t rf24_group_add(rf24_group_t * group, rf24_t * radio, rf24_group_callback_t callback, void * ctx)
+{
+  struct epoll_event ev;
+  uint32_t events;
+  int32_t fd;
+
+  if (group->count == RF24_GROUP_MAX_RADIOS) {
+    fprintf(stderr, "[rf24_group] Too many radios in group.\n");
+    return -1;
+  }
+
+  if ((fd = rf24_get_irq_fd(radio, &events)) == -1) {
+    fprintf(stderr, "[rf24_group] Radio has no IRQ descriptor.\n");
+    return -1;
+  }
+
+  /* the poll bits the transport reports are the same as their epoll ones */
+  ev.events   = events;
+  ev.data.u32 = group->count;
+  if (epoll_ctl(group->epfd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+    fprintf(stderr, "[rf24_group] Error adding IRQ descriptor %d: %s\n", fd, strerror(errno));
+    return -1;
+  }
+
+  group->members[group->count].radio    = radio;
+  group->members[group->count].callback = callback;
+  group->members[group->count].ctx      = ctx;
+  group->count++;
+
+  return 0;
+}
+
+int8_t rf24_group_remove(rf24_group_t * group, rf24_t * radio)
+{
+  struct epoll_event ev;
+  uint32_t events;
+  int32_t fd;
+  uint8_t i, last;
+
+  for (i = 0; i < group->count && group->members[i].radio != radio; i++);
+  if (i == group->count) { return -1; }
+
+  epoll_ctl(group->epfd, EPOLL_CTL_DEL, rf24_get_irq_fd(radio, &events), NULL);
+
+  /* the last member fills the hole, its epoll entry has to follow it to the new index */
+  last = --group->count;
+  if (i != last) {
+    group->members[i] = group->members[last];
+    fd = rf24_get_irq_fd(group->members[i].radio, &events);
+    ev.events   = events;
+    ev.data.u32 = i;
+    epoll_ctl(group->epfd, EPOLL_CTL_MOD, fd, &ev);
+  }
+  if (group->next >= group->count) { group->next = 0; }
+
+  return 0;
+}
+
+int8_t rf24_group_poll(rf24_group_t * group, int32_t timeout_ms)
+{
+  struct epoll_event events[RF24_GROUP_MAX_RADIOS];
+  int ret, i;
+  uint32_t member;
+
+  ret = epoll_wait(group->epfd, events, RF24_GROUP_MAX_RADIOS, timeout_ms);
+  if (ret == -1) {
+    if (errno == EINTR) { return 0; }
+    fprintf(stderr, "[rf24_group] Error waiting for irqs: %s\n", strerror(errno));
+    return -1;
+  }
+
+  for (i = 0; i < ret; i++) {
+    member = events[i].data.u32;
+    if (member >= group->count) { continue; }
+
+    rf24_process(group->members[member].radio, RF24_GROUP_MAX_EVENTS);
+    if (group->members[member].callback != NULL) {
+      group->members[member].callback(group, group->members[member].radio, group->members[member].ctx);
+    }
+  }
+
+  return ret;
+}
+
+int8_t rf24_group_send_async(rf24_group_t * group, void * buf, uint8_t len, rf24_send_callback_t callback, void * ctx)
+{
+  rf24_t * radio, * best = NULL;
+  uint8_t i, n, chosen = 0;
+
+  /* fewest sends in flight wins, ties go round robin from where the last send went */
+  for (n = 0; n < group->count; n++) {
+    i = (group->next + n) % group->count;
+    radio = group->members[i].radio;
+    if (radio->tx_streaming || radio->tx_count == RF24_TX_FIFO_DEPTH) { continue; }
+    if (best == NULL || radio->tx_count < best->tx_count) {
+      best   = radio;
+      chosen = i;
+    }
+  }
+
+  if (best == NULL || rf24_send_async(best, buf, len, callback, ctx) == -1) {
+    return -1;
+  }
+  group->next = (chosen + 1) % group->count;
+
+  return chosen;
+}
+// vim:ai:cin:et:sts=2 sw=2 ft=c
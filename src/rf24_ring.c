@@ -0,0 +1,82 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "rf24_ring.h"
+
+int8_t rf24_ring_init(rf24_ring_t * ring, uint32_t size)
+{
+  memset(ring, 0, sizeof(rf24_ring_t));
+
+  /* a power of two lets the free running indexes wrap with a mask */
+  if (size < 2 || (size & (size - 1)) != 0) {
+    fprintf(stderr, "[rf24_ring] Ring size %d is not a power of two.\n", size);
+    return -1;
+  }
+
+  if ((ring->frames = calloc(size, sizeof(rf24_frame_t))) == NULL) {
+    fprintf(stderr, "[rf24_ring] Error allocating %d frames.\n", size);
+    return -1;
+  }
+  ring->mask = size - 1;
+
+  return 0;
+}
+
+void rf24_ring_free(rf24_ring_t * ring)
+{
+  free(ring->frames);
+  ring->frames = NULL;
+}
+
+int8_t rf24_ring_push(rf24_ring_t * ring, const rf24_frame_t * frame)
+{
+  uint32_t head = ring->head;
+  uint32_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+
+  if (head - tail > ring->mask) {
+    ring->dropped++;
+    if (!ring->full) { ring->overruns++; }
+    ring->full = 1;
+    return -1;
+  }
+  ring->full = 0;
+
+  memcpy(&ring->frames[head & ring->mask], frame, sizeof(rf24_frame_t));
+  __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+
+  return 0;
+}
+
+int8_t rf24_ring_pop(rf24_ring_t * ring, rf24_frame_t * frame)
+{
+  uint32_t tail = ring->tail;
+  uint32_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+
+  if (head == tail) { return -1; }
+
+  memcpy(frame, &ring->frames[tail & ring->mask], sizeof(rf24_frame_t));
+  __atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+
+  return 0;
+}
+
+uint32_t rf24_ring_count(rf24_ring_t * ring)
+{
+  return __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+}
+
+/* Writes the free frames, pushing side only: calloc() leaves the pages to
+ * be faulted in by the first push that reaches them.
+ */
+void rf24_ring_prefault(rf24_ring_t * ring)
+{
+  uint32_t head = ring->head;
+  uint32_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+  uint32_t i;
+
+  for (i = head; i - tail <= ring->mask; i++) {
+    memset(&ring->frames[i & ring->mask], 0, sizeof(rf24_frame_t));
+  }
+}
+// vim:ai:cin:et:sts=2 sw=2 ft=c
@@ -0,0 +1,258 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "rf24_sched.h"
+#include "nRF24L01.h"
+
+#define _BV(x) (1 << (x))
+
+int8_t rf24_sched_init(rf24_sched_t * sched, rf24_t * radio, uint16_t max_nodes, uint64_t shared_address, uint32_t window_ms, rf24_sched_callback_t callback, void * ctx)
+{
+  uint64_t addresses[6] = { 0 };
+
+  memset(sched, 0, sizeof(rf24_sched_t));
+  sched->radio          = radio;
+  sched->max_nodes      = max_nodes;
+  sched->shared_address = shared_address;
+  sched->window_ms      = window_ms;
+  sched->callback       = callback;
+  sched->ctx            = ctx;
+
+  if (max_nodes == 0 || window_ms == 0) {
+    fprintf(stderr, "[rf24_sched] Need room for a node and a window of at least 1ms.\n");
+    return -1;
+  }
+  if ((sched->nodes = calloc(max_nodes, sizeof(rf24_sched_node_t))) == NULL) {
+    fprintf(stderr, "[rf24_sched] Error allocating %d nodes.\n", max_nodes);
+    return -1;
+  }
+
+  /* the shared address goes on pipe 1, the rotated pipes stay closed until there is someone to listen to */
+  addresses[1] = shared_address;
+  rf24_set_reading_pipes(radio, _BV(ERX_P1), addresses, _BV(ERX_P2) | _BV(ERX_P3) | _BV(ERX_P4) | _BV(ERX_P5));
+  sched->window_started_ns = rf24_now_ns();
+
+  return 0;
+}
+
+void rf24_sched_free(rf24_sched_t * sched)
+{
+  free(sched->nodes);
+  sched->nodes = NULL;
+  sched->count = 0;
+}
+
+/* Index of id in the registry, or -(where it would go) - 1 */
+static int32_t rf24_sched_index(rf24_sched_t * sched, uint16_t id)
+{
+  int32_t low = 0, high = sched->count - 1, mid;
+
+  while (low <= high) {
+    mid = (low + high) / 2;
+    if (sched->nodes[mid].id == id) { return mid; }
+    if (sched->nodes[mid].id < id) { low = mid + 1; } else { high = mid - 1; }
+  }
+
+  return -low - 1;
+}
+
+rf24_sched_node_t * rf24_sched_find(rf24_sched_t * sched, uint16_t id)
+{
+  int32_t index = rf24_sched_index(sched, id);
+
+  return index < 0 ? NULL : &sched->nodes[index];
+}
+
+/* Registers node id. address 0 puts it on the shared address, anything else
+ * has to differ from the shared address in the low byte only.
+ */
+int8_t rf24_sched_add(rf24_sched_t * sched, uint16_t id, uint64_t address, void * ctx)
+{
+  rf24_sched_node_t * node;
+  int32_t index;
+  uint16_t i;
+
+  if (sched->count == sched->max_nodes) {
+    fprintf(stderr, "[rf24_sched] No room for node %d.\n", id);
+    return -1;
+  }
+  if ((index = rf24_sched_index(sched, id)) >= 0) { return -1; }
+
+  if (address != 0) {
+    if ((address >> 8) != (sched->shared_address >> 8) || (uint8_t) address == (uint8_t) sched->shared_address) {
+      fprintf(stderr, "[rf24_sched] Address of node %d has to share all but its low byte with the shared address.\n", id);
+      return -1;
+    }
+    for (i = 0; i < sched->count; i++) {
+      if (!sched->nodes[i].shared && (uint8_t) sched->nodes[i].address == (uint8_t) address) { return -1; }
+    }
+  }
+
+  index = -index - 1;
+  memmove(&sched->nodes[index + 1], &sched->nodes[index], (sched->count - index) * sizeof(rf24_sched_node_t));
+  sched->count++;
+
+  node = &sched->nodes[index];
+  memset(node, 0, sizeof(rf24_sched_node_t));
+  node->id      = id;
+  node->shared  = address == 0;
+  node->address = address;
+  node->pipe    = RF24_SCHED_NO_PIPE;
+  node->ctx     = ctx;
+
+  if (!node->shared) { sched->rotated++; }
+  /* keep the rotation where it was */
+  if (sched->cursor > index) { sched->cursor++; }
+
+  return 0;
+}
+
+int8_t rf24_sched_remove(rf24_sched_t * sched, uint16_t id)
+{
+  rf24_sched_node_t * node;
+  int32_t index;
+  uint8_t slot;
+
+  if ((index = rf24_sched_index(sched, id)) < 0) { return -1; }
+  node = &sched->nodes[index];
+
+  if (node->pipe != RF24_SCHED_NO_PIPE) {
+    slot = node->pipe - RF24_SCHED_FIRST_PIPE;
+    sched->pipes_used &= ~_BV(slot);
+    rf24_clear_ack_queue(sched->radio, node->pipe);
+    rf24_set_reading_pipes(sched->radio, 0, NULL, _BV(node->pipe));
+  }
+  if (!node->shared) { sched->rotated--; }
+
+  memmove(node, node + 1, (sched->count - index - 1) * sizeof(rf24_sched_node_t));
+  sched->count--;
+
+  if (sched->cursor > index) { sched->cursor--; }
+  if (sched->cursor >= sched->count) { sched->cursor = 0; }
+
+  return 0;
+}
+
+static void rf24_sched_dispatch(rf24_sched_t * sched, const rf24_frame_t * frame)
+{
+  rf24_sched_node_t * node = NULL;
+  uint8_t slot = frame->pipe - RF24_SCHED_FIRST_PIPE;
+
+  if (frame->pipe == 1 && frame->len >= RF24_SCHED_ID_LEN) {
+    node = rf24_sched_find(sched, frame->data[0] | (frame->data[1] << 8));
+    if (node != NULL && !node->shared) { node = NULL; }
+  } else if (frame->pipe >= RF24_SCHED_FIRST_PIPE && slot < RF24_SCHED_PIPES && (sched->pipes_used & _BV(slot))) {
+    node = rf24_sched_find(sched, sched->pipe_ids[slot]);
+  }
+
+  if (node == NULL) {
+    sched->stats.unknown++;
+    return;
+  }
+
+  node->last_seen_ns = frame->timestamp_ns;
+  node->frames++;
+  sched->stats.frames++;
+
+  if (sched->callback != NULL) {
+    sched->callback(sched, node, frame, sched->ctx);
+  }
+}
+
+static void rf24_sched_drain(rf24_sched_t * sched)
+{
+  rf24_frame_t frames[RF24_RX_FIFO_DEPTH];
+  int8_t count, i;
+
+  do {
+    count = rf24_receive_all(sched->radio, frames, RF24_RX_FIFO_DEPTH);
+    for (i = 0; i < count; i++) {
+      rf24_sched_dispatch(sched, &frames[i]);
+    }
+  } while (count == RF24_RX_FIFO_DEPTH);
+}
+
+/* Starts the next window: the next nodes in line get the rotated pipes,
+ * those keeping theirs are not rewritten.
+ */
+void rf24_sched_rotate(rf24_sched_t * sched)
+{
+  uint64_t addresses[6] = { 0 };
+  uint16_t picks[RF24_SCHED_PIPES], index, scanned;
+  rf24_sched_node_t * node;
+  uint8_t picked = 0, mask = 0, close_mask = 0, slot, i;
+
+  rf24_sched_drain(sched);
+  sched->window_started_ns = rf24_now_ns();
+
+  for (index = sched->cursor, scanned = 0; picked < RF24_SCHED_PIPES && scanned < sched->count; scanned++) {
+    if (!sched->nodes[index].shared) { picks[picked++] = index; }
+    index = (index + 1) % sched->count;
+  }
+  sched->cursor = sched->count ? index : 0;
+
+  /* the ones whose turn is over give their pipe up */
+  for (slot = 0; slot < RF24_SCHED_PIPES; slot++) {
+    if (!(sched->pipes_used & _BV(slot))) { continue; }
+
+    node = rf24_sched_find(sched, sched->pipe_ids[slot]);
+    for (i = 0; i < picked && &sched->nodes[picks[i]] != node; i++);
+    if (i < picked) { continue; }
+
+    if (node != NULL) { node->pipe = RF24_SCHED_NO_PIPE; }
+    sched->pipes_used &= ~_BV(slot);
+    close_mask |= _BV(RF24_SCHED_FIRST_PIPE + slot);
+  }
+
+  for (i = 0; i < picked; i++) {
+    node = &sched->nodes[picks[i]];
+    if (node->pipe != RF24_SCHED_NO_PIPE) { continue; }
+
+    for (slot = 0; sched->pipes_used & _BV(slot); slot++);
+    sched->pipes_used   |= _BV(slot);
+    sched->pipe_ids[slot] = node->id;
+    node->pipe = RF24_SCHED_FIRST_PIPE + slot;
+
+    addresses[node->pipe] = node->address;
+    mask |= _BV(node->pipe);
+    sched->stats.pipe_writes++;
+  }
+
+  sched->stats.rotations++;
+  if ((mask | close_mask) == 0) { return; }
+
+  /* acks for the last holder of a pipe, queued or in the chip, must not reach the next one */
+  rf24_clear_ack_queues(sched->radio, mask | close_mask);
+
+  /* a pipe reopened for someone else is open, not closed */
+  close_mask &= ~mask;
+  rf24_set_reading_pipes(sched->radio, mask, addresses, close_mask);
+}
+
+/* Hands what is in the RX FIFO to the callback and rotates once the window
+ * is over. Returns the ms left in the window, to wait on the IRQ for.
+ */
+int32_t rf24_sched_run(rf24_sched_t * sched)
+{
+  uint64_t elapsed_ms;
+
+  rf24_sched_drain(sched);
+
+  elapsed_ms = (rf24_now_ns() - sched->window_started_ns) / 1000000;
+  if (elapsed_ms >= sched->window_ms) {
+    rf24_sched_rotate(sched);
+    return sched->window_ms;
+  }
+
+  return sched->window_ms - elapsed_ms;
+}
+
+/* Time it takes every rotated node to have had a window. With no more of
+ * them than rotated pipes nobody ever waits, the pipes stay as they are.
+ */
+uint32_t rf24_sched_cycle_ms(rf24_sched_t * sched)
+{
+  return (sched->rotated + RF24_SCHED_PIPES - 1) / RF24_SCHED_PIPES * sched->window_ms;
+}
+// vim:ai:cin:et:sts=2 sw=2 ft=c
@@ -0,0 +1,149 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <sched.h>
+#include <sys/mman.h>
+
+#include "rf24_thread.h"
+#include "rf24_ring.h"
+
+/* touches size bytes below the current frame, the pages stay mapped for the calls made from the loop */
+static void __attribute__((noinline)) rf24_thread_prefault(uint32_t size)
+{
+  uint8_t stack[size];
+
+  memset(stack, 0, size);
+  __asm__ volatile ("" : : "r" (stack) : "memory");
+}
+
+/* writes the free RX slots and ring frames, the first payloads land in pages already there */
+static void rf24_thread_prefault_buffers(rf24_t * radio)
+{
+  uint32_t used = __atomic_load_n(&radio->rx_slots_used, __ATOMIC_ACQUIRE);
+  uint8_t slot;
+
+  for (slot = 0; slot < RF24_RX_SLOTS; slot++) {
+    if (!(used & (1U << slot))) { memset(radio->rx_slots[slot].raw, 0, sizeof(radio->rx_slots[slot].raw)); }
+  }
+  if (radio->rx_ring != NULL) {
+    rf24_ring_prefault(radio->rx_ring);
+  }
+}
+
+static void * rf24_thread_run(void * data)
+{
+  rf24_thread_t * thread = (rf24_thread_t *) data;
+  rf24_t * radio = thread->radio;
+  uint64_t timestamp, woken;
+  int8_t ret;
+
+  if (thread->attr.prefault_stack > 0) {
+    rf24_thread_prefault(thread->attr.prefault_stack);
+    rf24_thread_prefault_buffers(radio);
+  }
+
+  while (__atomic_load_n(&thread->running, __ATOMIC_ACQUIRE)) {
+    ret = radio->transport->irq_wait(radio->transport_ctx, RF24_THREAD_STOP_POLL_MS, &timestamp);
+    if (ret == -1) {
+      fprintf(stderr, "[rf24_thread] Error waiting for irq on pin %d\n", radio->irq_pin);
+      break;
+    } else if (ret == 0) {
+      continue;
+    }
+
+    woken = rf24_now_ns();
+    rf24_service_irq(radio, timestamp, thread->callback);
+
+    thread->stats.wakeups++;
+    rf24_histogram_add(&thread->stats.wakeup_latency, woken - timestamp);
+    rf24_histogram_add(&thread->stats.service_latency, rf24_now_ns() - timestamp);
+  }
+
+  return NULL;
+}
+
+void rf24_thread_attr_init(rf24_thread_attr_t * attr)
+{
+  memset(attr, 0, sizeof(rf24_thread_attr_t));
+  attr->cpu = -1;
+}
+
+int8_t rf24_thread_start(rf24_thread_t * thread, rf24_t * radio, void (* callback)(void * radio), const rf24_thread_attr_t * attr)
+{
+  pthread_attr_t pattr;
+  struct sched_param param;
+  cpu_set_t cpus;
+  size_t stack;
+  int ret;
+
+  memset(thread, 0, sizeof(rf24_thread_t));
+  thread->radio    = radio;
+  thread->callback = callback;
+  if (attr != NULL) {
+    thread->attr = *attr;
+  } else {
+    rf24_thread_attr_init(&thread->attr);
+  }
+
+  if (thread->attr.lock_memory && mlockall(MCL_CURRENT | MCL_FUTURE) == -1) {
+    fprintf(stderr, "[rf24_thread] Error locking memory: %s\n", strerror(errno));
+    return -1;
+  }
+
+  pthread_attr_init(&pattr);
+
+  /* the prefault is a VLA on the thread's own stack, it has to fit with room to spare */
+  if (thread->attr.prefault_stack > 0) {
+    pthread_attr_getstacksize(&pattr, &stack);
+    if (stack < (size_t) thread->attr.prefault_stack + RF24_THREAD_STACK_MARGIN &&
+        (ret = pthread_attr_setstacksize(&pattr, (size_t) thread->attr.prefault_stack + RF24_THREAD_STACK_MARGIN)) != 0) {
+      fprintf(stderr, "[rf24_thread] Error sizing the stack for %d prefaulted bytes: %s\n", thread->attr.prefault_stack, strerror(ret));
+      pthread_attr_destroy(&pattr);
+      return -1;
+    }
+  }
+
+  if (thread->attr.priority > 0) {
+    memset(&param, 0, sizeof(param));
+    param.sched_priority = thread->attr.priority;
+    pthread_attr_setinheritsched(&pattr, PTHREAD_EXPLICIT_SCHED);
+    pthread_attr_setschedpolicy(&pattr, SCHED_FIFO);
+    pthread_attr_setschedparam(&pattr, &param);
+  }
+
+  if (thread->attr.cpu >= 0) {
+    CPU_ZERO(&cpus);
+    CPU_SET(thread->attr.cpu, &cpus);
+    pthread_attr_setaffinity_np(&pattr, sizeof(cpus), &cpus);
+  }
+
+  thread->running = 1;
+  ret = pthread_create(&thread->thread, &pattr, rf24_thread_run, thread);
+  pthread_attr_destroy(&pattr);
+
+  if (ret != 0) {
+    /* EPERM without CAP_SYS_NICE or an RT budget, EINVAL for a CPU that is not there */
+    fprintf(stderr, "[rf24_thread] Error starting service thread: %s\n", strerror(ret));
+    thread->running = 0;
+    return -1;
+  }
+
+  return 0;
+}
+
+void rf24_thread_stop(rf24_thread_t * thread)
+{
+  if (!thread->running) { return; }
+
+  __atomic_store_n(&thread->running, 0, __ATOMIC_RELEASE);
+  pthread_join(thread->thread, NULL);
+}
+
+void rf24_thread_get_stats(rf24_thread_t * thread, rf24_thread_stats_t * stats)
+{
+  /* the thread keeps counting meanwhile, a copy taken while it runs may be off by an IRQ */
+  memcpy(stats, &thread->stats, sizeof(rf24_thread_stats_t));
+}
+// vim:ai:cin:et:sts=2 sw=2 ft=c
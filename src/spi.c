@@ -1,4 +1,6 @@
 #include <stdio.h>
+#include <assert.h>
+#include <string.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <sys/ioctl.h>
@@ -7,79 +9,171 @@
 
 #include "spi.h"
 
-int32_t spi_open(char * dev)
+int32_t spi_open(spi_t * spi, char * dev)
 {
-  int fd;
-  fd = open(dev, O_RDWR);
-  if (fd == -1) {
+  memset(spi, 0, sizeof(spi_t));
+
+  spi->fd = open(dev, O_RDWR);
+  if (spi->fd == -1) {
      fprintf(stderr, "[spi] Error opening %s\n", dev);
+     return -1;
+  }
+
+  /* cache the current settings, spi_config() keeps them up to date */
+  if (ioctl(spi->fd, SPI_IOC_RD_MAX_SPEED_HZ, &spi->speed) == -1) {
+    fprintf(stderr, "[spi] Error getting SPI device speed.\n");
+  }
+
+  if (ioctl(spi->fd, SPI_IOC_RD_BITS_PER_WORD, &spi->bits) == -1) {
+    fprintf(stderr, "[spi] Error getting SPI device bits per word.\n");
   }
-  return fd;
+
+  return spi->fd;
 }
 
-int32_t spi_close(uint32_t fd)
+int32_t spi_close(spi_t * spi)
 {
-  if (close(fd) == -1) {
+  if (close(spi->fd) == -1) {
      fprintf(stderr, "[spi] Error closing spi device\n");
      return -1;
   }
+  spi->fd = -1;
   return 0;
 }
 
-int8_t spi_config(uint32_t fd, uint8_t bits, uint32_t speed, uint8_t mode)
+int8_t spi_config(spi_t * spi, uint8_t bits, uint32_t speed, uint8_t mode)
 {
-  if (ioctl(fd, SPI_IOC_WR_MODE, &mode) == -1) {
+  if (ioctl(spi->fd, SPI_IOC_WR_MODE, &mode) == -1) {
     fprintf(stderr, "[spi] Error setting SPI mode to %d\n", mode);
     return -1;
   }
+  spi->mode = mode;
 
-  if (ioctl(fd, SPI_IOC_WR_BITS_PER_WORD, &bits) == -1) {
+  if (ioctl(spi->fd, SPI_IOC_WR_BITS_PER_WORD, &bits) == -1) {
     fprintf(stderr, "[spi] Error setting SPI bits per word to %d\n", bits);
     return -1;
   }
+  spi->bits = bits;
 
-  if (ioctl(fd, SPI_IOC_WR_MAX_SPEED_HZ, &speed) == -1) {
+  if (ioctl(spi->fd, SPI_IOC_WR_MAX_SPEED_HZ, &speed) == -1) {
     fprintf(stderr, "[spi] Error setting SPI speed to %d\n", speed);
     return -1;
   }
+  spi->speed = speed;
 
   return 0;
 }
 
-int8_t spi_transfer(uint32_t fd, uint8_t payload)
+int8_t spi_transfer(spi_t * spi, uint8_t payload)
 {
-  uint32_t speed = 0;
-  uint8_t bits   = 0;
-
-  uint8_t tx[] = {payload};
-  uint8_t rx[] = {0};
+  uint8_t rx = 0;
 
-  if (ioctl(fd, SPI_IOC_RD_MAX_SPEED_HZ, &speed) == -1) {
-    fprintf(stderr, "[spi] Error getting SPI device speed.\n");
+  if (spi_transfer_buf(spi, &payload, &rx, 1) == -1) {
     return -1;
   }
 
-  if (ioctl(fd, SPI_IOC_RD_BITS_PER_WORD, &bits) == -1) {
-    fprintf(stderr, "[spi] Error getting SPI device bits per word.\n");
-    return -1;
-  }
+  return rx;
+}
 
+int8_t spi_transfer_buf(spi_t * spi, const uint8_t * tx, uint8_t * rx, uint32_t len)
+{
   struct spi_ioc_transfer tr = {
-	  .tx_buf        = (uint32_t) tx,
-	  .rx_buf        = (uint32_t) rx,
-	  .len           = sizeof(tx) / sizeof(tx[0]),
+	  .tx_buf        = (uintptr_t) tx,
+	  .rx_buf        = (uintptr_t) rx,
+	  .len           = len,
 	  .delay_usecs   = 0,
-	  .speed_hz      = speed,
-	  .bits_per_word = bits,
+	  .speed_hz      = spi->speed,
+	  .bits_per_word = spi->bits,
   };
 
-  if (ioctl(fd, SPI_IOC_MESSAGE(1), &tr) == -1) {
+  if (ioctl(spi->fd, SPI_IOC_MESSAGE(1), &tr) == -1) {
     fprintf(stderr, "[spi] Error sending SPI message.\n");
     return -1;
-  } else {
-    //fprintf(stderr, "[spi] Sent %d, received %d\n", tx[0], rx[0]);
   }
 
-  return rx[0];
+  return 0;
+}
+
+void spi_msg_init(spi_msg_t * msg)
+{
+  /* transfers are cleared as they get added */
+  msg->count = 0;
+}
+
+int8_t spi_msg_add(spi_msg_t * msg, const uint8_t * tx, uint8_t * rx, uint32_t len)
+{
+  struct spi_ioc_transfer * tr;
+
+  if (msg->count == SPI_MSG_MAX_XFERS) {
+    fprintf(stderr, "[spi] Too many transfers in SPI message.\n");
+    return -1;
+  }
+
+  /* deselect the device between the previous transfer and this one */
+  if (msg->count > 0) {
+    msg->xfer[msg->count - 1].cs_change = 1;
+  }
+
+  tr = &msg->xfer[msg->count++];
+  memset(tr, 0, sizeof(struct spi_ioc_transfer));
+  tr->tx_buf = (uintptr_t) tx;
+  tr->rx_buf = (uintptr_t) rx;
+  tr->len    = len;
+
+  return 0;
+}
+
+int8_t spi_msg_append(spi_msg_t * msg, const uint8_t * tx, uint8_t * rx, uint32_t len)
+{
+  struct spi_ioc_transfer * tr;
+
+  if (msg->count == SPI_MSG_MAX_XFERS) {
+    fprintf(stderr, "[spi] Too many transfers in SPI message.\n");
+    return -1;
+  }
+
+  /* no cs_change on the transfer before, the device stays selected across both */
+  tr = &msg->xfer[msg->count++];
+  memset(tr, 0, sizeof(struct spi_ioc_transfer));
+  tr->tx_buf = (uintptr_t) tx;
+  tr->rx_buf = (uintptr_t) rx;
+  tr->len    = len;
+
+  return 0;
+}
+
+int8_t spi_msg_submit(spi_t * spi, spi_msg_t * msg)
+{
+  return spi_msg_submit_range(spi, msg, 0, msg->count);
+}
+
+int8_t spi_msg_submit_range(spi_t * spi, spi_msg_t * msg, uint8_t first, uint8_t count)
+{
+  struct spi_ioc_transfer * last;
+  uint8_t cs_change, i;
+  int ret;
+
+  assert(first + count <= msg->count);
+  if (count == 0) { return 0; }
+
+  for (i = first; i < first + count; i++) {
+    msg->xfer[i].speed_hz      = spi->speed;
+    msg->xfer[i].bits_per_word = spi->bits;
+  }
+
+  /* on the last transfer cs_change would keep the device selected after the message */
+  last = &msg->xfer[first + count - 1];
+  cs_change = last->cs_change;
+  last->cs_change = 0;
+
+  ret = ioctl(spi->fd, SPI_IOC_MESSAGE(count), &msg->xfer[first]);
+  last->cs_change = cs_change;
+
+  if (ret == -1) {
+    fprintf(stderr, "[spi] Error sending SPI message.\n");
+    return -1;
+  }
+
+  return 0;
 }
 // vim:ai:cin:et:sts=2 sw=2 ft=c